@@ -0,0 +1,242 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+
+namespace mxprops {
+
+// Monotonic memory arena: small allocations are carved from large chunks and
+// are released all at once by reset().  Freed small blocks are recycled for
+// allocations of the same size, so erasing and re-inserting map nodes does
+// not grow the arena; larger blocks come from the heap and go back to it when
+// freed, each in constant time.  Only memory is managed: reset() runs no
+// destructors, so whatever lives in the arena must have been destroyed
+// already.  Not thread-safe; PTree uses it under its own mutex.
+class Arena : private boost::noncopyable
+{
+public:
+  explicit Arena(size_t chunkSize = 64 * 1024)
+  : chunkSize(chunkSize < MAX_RECYCLED * 4 ? MAX_RECYCLED * 4 : chunkSize),
+    current(0),
+    pos(0),
+    largeBytes(0),
+    freeLists(MAX_RECYCLED / ALIGNMENT + 1, static_cast<FreeBlock *>(0))
+  { }
+
+  ~Arena()
+  {
+    reset();
+    for (size_t i = 0; i < chunks.size(); ++i)
+      ::operator delete(chunks[i]);
+  }
+
+  void * allocate(size_t size)
+  {
+    size = roundUp(size);
+    if (size <= MAX_RECYCLED && freeLists[size / ALIGNMENT])
+    {
+      FreeBlock *b = freeLists[size / ALIGNMENT];
+      freeLists[size / ALIGNMENT] = b->next;
+      return b;
+    }
+
+    if (size > MAX_RECYCLED)
+    {
+      // a header before the block keeps its index in large
+      char *block = static_cast<char *>(::operator new(size + ALIGNMENT));
+      *reinterpret_cast<size_t *>(block) = large.size();
+      large.push_back(block);
+      largeBytes += size;
+      return block + ALIGNMENT;
+    }
+
+    if (current < chunks.size() && chunkSize - pos < size)
+    {
+      ++current;
+      pos = 0;
+    }
+    if (current == chunks.size())
+      chunks.push_back(static_cast<char *>(::operator new(chunkSize)));
+
+    void *p = chunks[current] + pos;
+    pos += size;
+    return p;
+  }
+
+  void deallocate(void *p, size_t size)
+  {
+    size = roundUp(size);
+    if (!p)
+      return;
+    if (size > MAX_RECYCLED)
+    {
+      char *block = static_cast<char *>(p) - ALIGNMENT;
+      size_t const index = *reinterpret_cast<size_t *>(block);
+      large[index] = large.back();
+      *reinterpret_cast<size_t *>(large[index]) = index;
+      large.pop_back();
+      largeBytes -= size;
+      ::operator delete(block);
+      return;
+    }
+    FreeBlock *b = static_cast<FreeBlock *>(p);
+    b->next = freeLists[size / ALIGNMENT];
+    freeLists[size / ALIGNMENT] = b;
+  }
+
+  // Invalidates every allocation at once.  Chunks are kept and reused,
+  // so reloading the same amount of data allocates nothing new.
+  void reset()
+  {
+    for (size_t i = 0; i < large.size(); ++i)
+      ::operator delete(large[i]);
+    large.clear();
+    largeBytes = 0;
+    current = pos = 0;
+    std::fill(freeLists.begin(), freeLists.end(), static_cast<FreeBlock *>(0));
+  }
+
+  // chunks plus the large blocks in use
+  size_t getReservedBytes() const
+  {
+    return chunks.size() * chunkSize + largeBytes;
+  }
+
+private:
+  static size_t const ALIGNMENT = 16;
+  static size_t const MAX_RECYCLED = 512;
+
+  struct FreeBlock
+  {
+    FreeBlock *next;
+  };
+
+  static size_t roundUp(size_t size)
+  {
+    return size == 0 ? ALIGNMENT : (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  }
+
+  size_t chunkSize;
+  std::vector<char *> chunks;
+  size_t current; // chunk being bump-allocated from
+  size_t pos;     // offset of the free space in it
+  std::vector<char *> large; // each starting with its index here
+  size_t largeBytes;
+  std::vector<FreeBlock *> freeLists;
+};
+
+
+// Standard allocator over an Arena; without an arena it falls back to the
+// global operator new, so containers can switch modes at construction.
+template <typename T>
+class ArenaAllocator
+{
+public:
+  typedef T value_type;
+  typedef T * pointer;
+  typedef T const* const_pointer;
+  typedef T & reference;
+  typedef T const& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind
+  {
+    typedef ArenaAllocator<U> other;
+  };
+
+  explicit ArenaAllocator(Arena *arena = 0)
+  : arena(arena)
+  { }
+
+  template <typename U>
+  ArenaAllocator(ArenaAllocator<U> const& other)
+  : arena(other.getArena())
+  { }
+
+  pointer allocate(size_type n, void const* = 0)
+  {
+    size_t const bytes = n * sizeof(T);
+    return static_cast<pointer>(arena ? arena->allocate(bytes) : ::operator new(bytes));
+  }
+
+  void deallocate(pointer p, size_type n)
+  {
+    if (arena)
+      arena->deallocate(p, n * sizeof(T));
+    else
+      ::operator delete(p);
+  }
+
+  size_type max_size() const
+  {
+    return size_t(-1) / sizeof(T);
+  }
+
+  void construct(pointer p, T const& v)
+  {
+    new (static_cast<void *>(p)) T(v);
+  }
+
+  void destroy(pointer p)
+  {
+    p->~T();
+  }
+
+  pointer address(reference r) const { return &r; }
+  const_pointer address(const_reference r) const { return &r; }
+
+  Arena * getArena() const { return arena; }
+
+private:
+  Arena *arena;
+};
+
+template <typename T, typename U>
+inline bool operator == (ArenaAllocator<T> const& a, ArenaAllocator<U> const& b)
+{
+  return a.getArena() == b.getArena();
+}
+
+template <typename T, typename U>
+inline bool operator != (ArenaAllocator<T> const& a, ArenaAllocator<U> const& b)
+{
+  return a.getArena() != b.getArena();
+}
+
+} // namespace mxprops
@@ -0,0 +1,376 @@
+// Throughput and scaling baselines for mxprops.
+//
+// usage: mxprops_bench [--threads N] [--max-keys N] [--seconds S] [--dir D]
+//
+// Every result is printed as one "name value unit" line, so runs can be
+// compared with diff or collected by a script.
+
+#include <mxprops/mxprops.h>
+#include <mxprops/io.h>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#ifdef __unix__
+#include <sys/resource.h>
+#endif
+
+using namespace mxprops;
+
+namespace
+{
+
+struct Settings
+{
+  size_t threads;
+  size_t maxKeys;
+  double seconds;
+  std::string dir;
+
+  Settings()
+  : threads(boost::thread::hardware_concurrency()),
+    maxKeys(1000000),
+    seconds(1.0),
+    dir("/tmp")
+  {
+    if (threads == 0)
+      threads = 4;
+  }
+};
+
+double now()
+{
+  static boost::posix_time::ptime const start = boost::posix_time::microsec_clock::universal_time();
+  return (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+}
+
+// peak resident set of the process in kB; it never goes down, so loads are
+// run in ascending size
+long peakRssKb()
+{
+#ifdef __unix__
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    return usage.ru_maxrss;
+#endif
+  return 0;
+}
+
+void report(std::string const& name, double value, char const* unit)
+{
+  std::printf("%-40s %14.3f %s\n", name.c_str(), value, unit);
+  std::fflush(stdout);
+}
+
+std::string keyName(size_t i)
+{
+  return "s" + boost::lexical_cast<std::string>(i / 1000) + ".k" + boost::lexical_cast<std::string>(i % 1000);
+}
+
+// simple LCG, so threads do not share the state of rand()
+struct Random
+{
+  boost::uint32_t state;
+
+  explicit Random(boost::uint32_t seed)
+  : state(seed * 2654435761u + 1)
+  { }
+
+  size_t operator () (size_t n)
+  {
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) % n;
+  }
+};
+
+struct Reader
+{
+  PTree::ConstRef root;
+  std::vector<std::string> const& keys;
+  boost::atomic<bool> const& stop;
+  boost::uint64_t & ops;
+  boost::uint32_t seed;
+
+  Reader(PTree::ConstRef const& root, std::vector<std::string> const& keys,
+         boost::atomic<bool> const& stop, boost::uint64_t & ops, boost::uint32_t seed)
+  : root(root), keys(keys), stop(stop), ops(ops), seed(seed)
+  { }
+
+  void operator () ()
+  {
+    Random random(seed);
+    boost::uint64_t n = 0;
+    int sum = 0;
+    while (!stop.load(boost::memory_order_relaxed))
+    {
+      for (int i = 0; i < 64; ++i)
+        sum += root.get<int>(keys[random(keys.size())], 0);
+      n += 64;
+    }
+    ops = n + (sum == -1 ? 1 : 0); // keep the reads from being optimized away
+  }
+};
+
+struct Writer
+{
+  PTree::Ref root;
+  std::vector<std::string> const& keys;
+  boost::atomic<bool> const& stop;
+  boost::uint64_t & ops;
+  boost::uint32_t seed;
+
+  Writer(PTree::Ref const& root, std::vector<std::string> const& keys,
+         boost::atomic<bool> const& stop, boost::uint64_t & ops, boost::uint32_t seed)
+  : root(root), keys(keys), stop(stop), ops(ops), seed(seed)
+  { }
+
+  void operator () ()
+  {
+    Random random(seed);
+    boost::uint64_t n = 0;
+    while (!stop.load(boost::memory_order_relaxed))
+    {
+      for (int i = 0; i < 16; ++i)
+        root.set<int>(keys[random(keys.size())], static_cast<int>(n + i));
+      n += 16;
+    }
+    ops = n;
+  }
+};
+
+void benchGetSet(Settings const& settings, bool sharedReads, bool readCache)
+{
+  size_t const count = 100000;
+  PTree::Options options;
+  options.sharedReads = sharedReads;
+  PTree tree(options);
+  tree.setReadCache(readCache);
+  std::string const mode = std::string(sharedReads ? "-shared" : "") + (readCache ? "-cached" : "");
+  PTree::Ref root = tree.root("bench");
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    keys.push_back(keyName(i));
+    root.set<int>(keys.back(), static_cast<int>(i));
+  }
+
+  for (size_t writers = 0; writers <= 1; ++writers)
+    for (size_t readers = 1; readers <= settings.threads; readers *= 2)
+    {
+      boost::atomic<bool> stop(false);
+      std::vector<boost::uint64_t> readOps(readers, 0), writeOps(writers, 0);
+      boost::thread_group group;
+      for (size_t i = 0; i < readers; ++i)
+        group.create_thread(Reader(root, keys, stop, readOps[i], static_cast<boost::uint32_t>(i)));
+      for (size_t i = 0; i < writers; ++i)
+        group.create_thread(Writer(root, keys, stop, writeOps[i], static_cast<boost::uint32_t>(1000 + i)));
+
+      double const start = now();
+      boost::this_thread::sleep(boost::posix_time::milliseconds(static_cast<long>(settings.seconds * 1000)));
+      stop = true;
+      group.join_all();
+      double const elapsed = now() - start;
+
+      boost::uint64_t reads = 0, writes = 0;
+      for (size_t i = 0; i < readers; ++i)
+        reads += readOps[i];
+      for (size_t i = 0; i < writers; ++i)
+        writes += writeOps[i];
+
+      std::string const name = "get" + mode + "/" + boost::lexical_cast<std::string>(readers) + "r"
+                                      + boost::lexical_cast<std::string>(writers) + "w";
+      report(name, reads / elapsed / 1e6, "Mops/s");
+      if (writers)
+        report("set" + mode + "/" + boost::lexical_cast<std::string>(readers) + "r"
+                      + boost::lexical_cast<std::string>(writers) + "w",
+               writes / elapsed / 1e6, "Mops/s");
+    }
+}
+
+// Readers of one half of the keys while a writer updates the other half:
+// with a single tree lock, the writes still hold off the readers, and the
+// drop from 0w to 1w is what striping the lock by subtree could win back.
+void benchDisjointWrites(Settings const& settings)
+{
+  size_t const count = 100000;
+  PTree::Options options;
+  options.sharedReads = true;
+  PTree tree(options);
+  PTree::Ref root = tree.root("bench");
+  std::vector<std::string> readKeys, writeKeys;
+  for (size_t i = 0; i < count; ++i)
+  {
+    std::string const key = keyName(i);
+    root.set<int>(key, static_cast<int>(i));
+    (i < count / 2 ? writeKeys : readKeys).push_back(key);
+  }
+
+  for (size_t writers = 0; writers <= 1; ++writers)
+  {
+    size_t const readers = settings.threads;
+    boost::atomic<bool> stop(false);
+    std::vector<boost::uint64_t> readOps(readers, 0), writeOps(writers, 0);
+    boost::thread_group group;
+    for (size_t i = 0; i < readers; ++i)
+      group.create_thread(Reader(root, readKeys, stop, readOps[i], static_cast<boost::uint32_t>(i)));
+    for (size_t i = 0; i < writers; ++i)
+      group.create_thread(Writer(root, writeKeys, stop, writeOps[i], static_cast<boost::uint32_t>(1000 + i)));
+
+    double const start = now();
+    boost::this_thread::sleep(boost::posix_time::milliseconds(static_cast<long>(settings.seconds * 1000)));
+    stop = true;
+    group.join_all();
+    double const elapsed = now() - start;
+
+    boost::uint64_t reads = 0;
+    for (size_t i = 0; i < readers; ++i)
+      reads += readOps[i];
+    report("get-shared-disjoint/" + boost::lexical_cast<std::string>(readers) + "r"
+                                  + boost::lexical_cast<std::string>(writers) + "w",
+           reads / elapsed / 1e6, "Mops/s");
+  }
+}
+
+void benchListKeys(Settings const& settings)
+{
+  size_t const count = std::min<size_t>(settings.maxKeys, 100000);
+
+  PTree wide;
+  for (size_t i = 0; i < count; ++i)
+    wide.root("").set<int>("wide.k" + boost::lexical_cast<std::string>(i), static_cast<int>(i));
+
+  // branches of nested nodes, 32 levels deep, each node with a few leaves
+  PTree deep;
+  size_t const depth = 32;
+  size_t const branches = std::max<size_t>(count / (depth * 3), 1);
+  for (size_t b = 0; b < branches; ++b)
+  {
+    std::string path = "deep.b" + boost::lexical_cast<std::string>(b);
+    for (size_t i = 0; i < depth; ++i)
+    {
+      path += ".n";
+      for (int j = 0; j < 3; ++j)
+        deep.root("").set<int>(path + ".v" + boost::lexical_cast<std::string>(j), j);
+    }
+  }
+
+  int const rounds = 10;
+  std::vector<std::string> keys;
+  double start = now();
+  for (int i = 0; i < rounds; ++i)
+  {
+    keys.clear();
+    wide.root("").getSubtree("wide").listKeys(keys);
+  }
+  report("listKeys/wide/" + boost::lexical_cast<std::string>(keys.size()), (now() - start) / rounds * 1e3, "ms");
+
+  start = now();
+  for (int i = 0; i < rounds; ++i)
+  {
+    keys.clear();
+    deep.root("").getSubtree("deep").listKeys(keys);
+  }
+  report("listKeys/deep/" + boost::lexical_cast<std::string>(keys.size()), (now() - start) / rounds * 1e3, "ms");
+
+  start = now();
+  for (int i = 0; i < rounds; ++i)
+  {
+    keys.clear();
+    deep.root("").getSubtree("deep").listKeysRecursive(keys);
+  }
+  report("listKeysRecursive/deep/" + boost::lexical_cast<std::string>(keys.size()), (now() - start) / rounds * 1e3, "ms");
+}
+
+// {"s0": {"k0": 0, ...}, "s1": ...} with 1000 keys per section
+bool writeConfig(std::string const& filename, size_t count)
+{
+  std::ofstream out(filename.c_str());
+  out << "{";
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (i % 1000 == 0)
+      out << (i ? "}," : "") << "\n\"s" << i / 1000 << "\": {";
+    else
+      out << ", ";
+    out << "\"k" << i % 1000 << "\": " << i;
+  }
+  out << (count ? "}" : "") << "\n}\n";
+  return out.good();
+}
+
+void benchJsonLoad(Settings const& settings)
+{
+  for (size_t count = 1000; count <= settings.maxKeys; count *= 10)
+  {
+    std::string const filename = settings.dir + "/mxprops_bench_" + boost::lexical_cast<std::string>(count) + ".json";
+    if (!writeConfig(filename, count))
+    {
+      std::cerr << "cannot write " << filename << std::endl;
+      return;
+    }
+
+    double start = now();
+    {
+      PTree tree;
+      std::vector<std::string> messages;
+      if (!load_from_json_file(tree.root(""), messages, filename))
+      {
+        for (size_t i = 0; i < messages.size(); ++i)
+          std::cerr << messages[i] << std::endl;
+        std::remove(filename.c_str());
+        return;
+      }
+      double const elapsed = now() - start;
+      std::string const suffix = "/" + boost::lexical_cast<std::string>(count);
+      report("load_from_json_file" + suffix, elapsed * 1e3, "ms");
+      report("load_from_json_file/peak_rss" + suffix, static_cast<double>(peakRssKb()), "kB");
+      report("memory_usage" + suffix, tree.getMemoryUsage().totalBytes / 1024.0, "kB");
+    }
+    std::remove(filename.c_str());
+  }
+}
+
+int usage(char const* program)
+{
+  std::cerr << "usage: " << program << " [--threads N] [--max-keys N] [--seconds S] [--dir D]" << std::endl;
+  return 1;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  Settings settings;
+  for (int i = 1; i < argc; i += 2)
+  {
+    if (i + 1 == argc)
+      return usage(argv[0]); // an option without its value
+    if (!std::strcmp(argv[i], "--threads"))
+      settings.threads = std::max(1, std::atoi(argv[i + 1]));
+    else if (!std::strcmp(argv[i], "--max-keys"))
+      settings.maxKeys = std::strtoul(argv[i + 1], 0, 10);
+    else if (!std::strcmp(argv[i], "--seconds"))
+      settings.seconds = std::atof(argv[i + 1]);
+    else if (!std::strcmp(argv[i], "--dir"))
+      settings.dir = argv[i + 1];
+    else
+      return usage(argv[0]);
+  }
+
+  // loads first: the peak RSS they report covers the whole process
+  benchJsonLoad(settings);
+  benchGetSet(settings, false, false);
+  benchGetSet(settings, true, false);
+  benchGetSet(settings, false, true);
+  benchGetSet(settings, true, true);
+  benchDisjointWrites(settings);
+  benchListKeys(settings);
+  return 0;
+}
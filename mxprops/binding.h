@@ -0,0 +1,167 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+#include "fieldset.h"
+#include <boost/mpl/identity.hpp>
+
+
+namespace mxprops {
+
+// Declarative list of struct fields read from a subtree in one pass:
+//
+//   Binding<CameraSettings> b;
+//   b.field("threshold", &CameraSettings::threshold)
+//    .field("roi", &CameraSettings::roi)              // std::vector -> array
+//    .field(MXPROPS_FIELD(CameraSettings, fps), 25);  // default if undefined
+//   b.read(ref.getSubtree("camera"), settings);
+//
+// All fields are looked up under a single lock in key order; every missing
+// or malformed field is reported, not just the first one.  A default only
+// replaces an undefined value, a malformed one is still an error.
+template <typename TStruct>
+class Binding
+{
+public:
+  Binding()
+  { }
+
+  template <typename TData>
+  Binding & field(std::string const& path, TData TStruct::*member)
+  {
+    return add(path, new Field<TData>(member, boost::optional<TData>()));
+  }
+
+  // the member alone gives TData: the default converts, as in a double
+  // member defaulting to 1
+  template <typename TData>
+  Binding & field(std::string const& path, TData TStruct::*member,
+                  typename boost::mpl::identity<TData>::type const& defaultValue)
+  {
+    return add(path, new Field<TData>(member, defaultValue));
+  }
+
+  // returns false and appends a message per bad field; good fields are assigned
+  bool read(PTree::ConstRef const& src, TStruct & dst, std::vector<std::string> & messages) const
+  {
+    Assigner a(dst);
+    return fields.check(src, a, messages);
+  }
+
+  // throws PropsError naming all bad fields
+  void read(PTree::ConstRef const& src, TStruct & dst) const
+  {
+    std::vector<std::string> messages;
+    if (read(src, dst, messages))
+      return;
+    std::string names;
+    for (size_t i = 0; i < messages.size(); ++i)
+      names += (i ? "; " : "") + messages[i];
+    throw PropsError(names, "Cannot read settings: ");
+  }
+
+private:
+  template <typename TData>
+  struct Extract
+  {
+    static boost::optional<TData> from(PTree::Record const& r) { return r.get_as<TData>(); }
+  };
+
+  template <typename TData>
+  struct Extract<std::vector<TData> >
+  {
+    static boost::optional<std::vector<TData> > from(PTree::Record const& r) { return r.get_array_as<TData>(); }
+  };
+
+  class FieldBase
+  {
+  public:
+    virtual ~FieldBase() { }
+
+    // r is 0 for a missing record; returns the error or an empty string
+    virtual char const* assign(PTree::Record const* r, TStruct & dst) const = 0;
+  };
+
+  template <typename TData>
+  class Field : public FieldBase
+  {
+  public:
+    Field(TData TStruct::*member, boost::optional<TData> const& defaultValue)
+    : member(member),
+      defaultValue(defaultValue)
+    { }
+
+    virtual char const* assign(PTree::Record const* r, TStruct & dst) const
+    {
+      if (!r || !r->isDefined())
+      {
+        if (!defaultValue)
+          return "Undefined property: ";
+        dst.*member = *defaultValue;
+        return "";
+      }
+      boost::optional<TData> const v = Extract<TData>::from(*r);
+      if (!v)
+        return "Bad format ";
+      dst.*member = *v;
+      return "";
+    }
+
+  private:
+    TData TStruct::*member;
+    boost::optional<TData> defaultValue;
+  };
+
+  struct Assigner
+  {
+    TStruct & dst;
+
+    explicit Assigner(TStruct & dst)
+    : dst(dst)
+    { }
+
+    char const* operator () (FieldBase const& f, std::string const&, PTree::Record const* r)
+    {
+      return f.assign(r, dst);
+    }
+  };
+
+  Binding & add(std::string const& path, FieldBase *f)
+  {
+    fields.add(path, f);
+    return *this;
+  }
+
+  FieldSet<FieldBase> fields;
+};
+
+#define MXPROPS_FIELD(TStruct, member) #member, &TStruct::member
+
+} // namespace mxprops
@@ -0,0 +1,270 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+
+#include <boost/optional.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/type_traits/is_integral.hpp>
+#include <boost/type_traits/is_floating_point.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include <boost/type_traits/is_signed.hpp>
+#include <boost/utility/enable_if.hpp>
+#include <boost/mpl/and.hpp>
+#include <boost/mpl/not.hpp>
+#include <boost/mpl/or.hpp>
+#include <boost/cstdint.hpp>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#if __cplusplus >= 201703L
+# include <charconv>
+#endif
+#if defined(__cpp_lib_to_chars)
+# define MXPROPS_USE_CHARCONV 1
+#endif
+
+
+namespace mxprops {
+
+// String <-> value conversion used by PTree::Record.  Arithmetic types and
+// bool are converted without streams: locale-independent, without
+// allocations besides the resulting string, and with doubles formatted so
+// that they parse back to the same value.  Other types fall back to the
+// property_tree stream translators.
+template <typename TData, typename Enable = void>
+struct Converter
+{
+  typedef typename boost::property_tree::translator_between<std::string, TData>::type Tr;
+
+  static boost::optional<TData> parse(std::string const& s)
+  {
+    return Tr().get_value(s);
+  }
+
+  static boost::optional<std::string> format(TData const& d)
+  {
+    return Tr().put_value(d);
+  }
+};
+
+template <>
+struct Converter<std::string>
+{
+  static boost::optional<std::string> parse(std::string const& s) { return s; }
+  static boost::optional<std::string> format(std::string const& d) { return d; }
+};
+
+// leading and trailing blanks and a leading '+' are accepted, as streams do
+struct NumberText
+{
+  char const* first;
+  char const* last;
+
+  explicit NumberText(std::string const& s)
+  : first(s.data()),
+    last(s.data() + s.size())
+  {
+    while (first != last && isBlank(*first))
+      ++first;
+    while (last != first && isBlank(last[-1]))
+      --last;
+    if (first != last && *first == '+' && last - first > 1 && first[1] != '-')
+      ++first;
+  }
+
+  static bool isBlank(char c)
+  {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+  }
+};
+
+template <>
+struct Converter<bool>
+{
+  static boost::optional<bool> parse(std::string const& s)
+  {
+    NumberText const t(s);
+    size_t const n = t.last - t.first;
+    if ((n == 1 && *t.first == '1') || (n == 4 && std::memcmp(t.first, "true", 4) == 0))
+      return true;
+    if ((n == 1 && *t.first == '0') || (n == 5 && std::memcmp(t.first, "false", 5) == 0))
+      return false;
+    return boost::optional<bool>();
+  }
+
+  static boost::optional<std::string> format(bool d)
+  {
+    return std::string(d ? "true" : "false");
+  }
+};
+
+// char and wchar_t are characters, not numbers, for the stream translators too
+template <typename TData>
+struct Converter<TData, typename boost::enable_if<
+    boost::mpl::and_<boost::is_integral<TData>,
+                     boost::mpl::not_<boost::mpl::or_<boost::is_same<TData, bool>,
+                                                      boost::is_same<TData, char>,
+                                                      boost::is_same<TData, wchar_t> > > > >::type>
+{
+  static boost::optional<TData> parse(std::string const& s)
+  {
+    NumberText const t(s);
+#ifdef MXPROPS_USE_CHARCONV
+    TData v;
+    std::from_chars_result const r = std::from_chars(t.first, t.last, v);
+    if (r.ec != std::errc() || r.ptr != t.last || t.first == t.last)
+      return boost::optional<TData>();
+    return v;
+#else
+    char const* p = t.first;
+    bool const negative = p != t.last && *p == '-';
+    if (negative)
+    {
+      if (!std::numeric_limits<TData>::is_signed)
+        return boost::optional<TData>();
+      ++p;
+    }
+    if (p == t.last)
+      return boost::optional<TData>();
+
+    boost::uintmax_t const limit = negative
+        ? boost::uintmax_t(-(std::numeric_limits<TData>::min() + 1)) + 1
+        : boost::uintmax_t(std::numeric_limits<TData>::max());
+    boost::uintmax_t m = 0;
+    for (; p != t.last; ++p)
+    {
+      if (*p < '0' || *p > '9')
+        return boost::optional<TData>();
+      unsigned const digit = *p - '0';
+      if (m > (limit - digit) / 10)
+        return boost::optional<TData>();
+      m = m * 10 + digit;
+    }
+    return negative ? TData(-TData(m - 1) - 1) : TData(m);
+#endif
+  }
+
+  static boost::optional<std::string> format(TData d)
+  {
+    char buf[std::numeric_limits<TData>::digits10 + 3];
+#ifdef MXPROPS_USE_CHARCONV
+    std::to_chars_result const r = std::to_chars(buf, buf + sizeof(buf), d);
+    return std::string(buf, r.ptr);
+#else
+    char *last = buf + sizeof(buf);
+    char *p = last;
+    bool const negative = d < 0;
+    boost::uintmax_t m = negative ? boost::uintmax_t(-(d + 1)) + 1 : boost::uintmax_t(d);
+    do
+    {
+      *--p = char('0' + m % 10);
+      m /= 10;
+    } while (m != 0);
+    if (negative)
+      *--p = '-';
+    return std::string(p, last);
+#endif
+  }
+};
+
+template <typename TData>
+struct Converter<TData, typename boost::enable_if<boost::is_floating_point<TData> >::type>
+{
+  static boost::optional<TData> parse(std::string const& s)
+  {
+    NumberText const t(s);
+    if (t.first == t.last)
+      return boost::optional<TData>();
+#ifdef MXPROPS_USE_CHARCONV
+    TData v;
+    std::from_chars_result const r = std::from_chars(t.first, t.last, v);
+    if (r.ec != std::errc() || r.ptr != t.last)
+      return boost::optional<TData>();
+    return v;
+#else
+    // strto* follow the C locale's decimal point, so swap it in
+    std::string buf(t.first, t.last);
+    char const point = *std::localeconv()->decimal_point;
+    if (point != '.')
+    {
+      size_t const dot = buf.find('.');
+      if (dot != std::string::npos)
+        buf[dot] = point;
+    }
+    char *end = 0;
+    TData const v = strto(buf.c_str(), &end, static_cast<TData *>(0));
+    if (end != buf.c_str() + buf.size())
+      return boost::optional<TData>();
+    return v;
+#endif
+  }
+
+  static boost::optional<std::string> format(TData d)
+  {
+    char buf[64];
+#ifdef MXPROPS_USE_CHARCONV
+    std::to_chars_result const r = std::to_chars(buf, buf + sizeof(buf), d); // shortest round-trip form
+    return std::string(buf, r.ptr);
+#else
+    // the shortest precision that reads back as the same value
+    int n = 0;
+    for (int digits = std::numeric_limits<TData>::digits10;
+         digits <= std::numeric_limits<TData>::digits10 + 3; ++digits)
+    {
+      n = std::sprintf(buf, "%.*Lg", digits, static_cast<long double>(d));
+      char *end = 0;
+      if (strto(buf, &end, static_cast<TData *>(0)) == d)
+        break;
+    }
+    char const point = *std::localeconv()->decimal_point;
+    if (point != '.')
+    {
+      char *p = std::strchr(buf, point);
+      if (p)
+        *p = '.';
+    }
+    return std::string(buf, n);
+#endif
+  }
+
+#ifndef MXPROPS_USE_CHARCONV
+private:
+  static float strto(char const* s, char **end, float *) { return ::strtof(s, end); }
+  static double strto(char const* s, char **end, double *) { return ::strtod(s, end); }
+  static long double strto(char const* s, char **end, long double *) { return ::strtold(s, end); }
+#endif
+};
+
+} // namespace mxprops
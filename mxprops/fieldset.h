@@ -0,0 +1,103 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+#include "mxprops.h"
+#include <boost/shared_ptr.hpp>
+
+
+namespace mxprops {
+
+// Fields declared by path, checked against a subtree in one pass; the common
+// part of Binding and Schema.  TField is the declaring class's field type.
+// For each path, check(field, path, record) is called with the record or 0
+// if it is missing, and returns an error prefix such as "Bad format ", or ""
+// for a good field.
+template <typename TField>
+class FieldSet
+{
+public:
+  bool empty() const { return paths.empty(); }
+
+  // sorted
+  std::vector<std::string> const& getPaths() const { return paths; }
+
+  // takes ownership of field
+  void add(std::string const& path, TField *field)
+  {
+    boost::shared_ptr<TField const> f(field);
+    size_t const pos = std::upper_bound(paths.begin(), paths.end(), path) - paths.begin();
+    paths.insert(paths.begin() + pos, path);
+    fields.insert(fields.begin() + pos, f);
+  }
+
+  // Returns false and appends a message naming the full path of each bad
+  // field.
+  template <typename TCheck>
+  bool check(PTree::ConstRef const& src, TCheck & check,
+             std::vector<std::string> & messages, bool countReads = true) const
+  {
+    Visitor<TCheck> v(*this, src, check, messages);
+    src.visitRecords(paths, v, countReads);
+    return v.ok;
+  }
+
+private:
+  template <typename TCheck>
+  struct Visitor
+  {
+    FieldSet const& set;
+    PTree::ConstRef const& src;
+    TCheck & check;
+    std::vector<std::string> & messages;
+    bool ok;
+
+    Visitor(FieldSet const& set, PTree::ConstRef const& src, TCheck & check,
+            std::vector<std::string> & messages)
+    : set(set), src(src), check(check), messages(messages), ok(true)
+    { }
+
+    void operator () (size_t i, PTree::Record const* r)
+    {
+      char const* error = check(*set.fields[i], set.paths[i], r);
+      if (*error)
+      {
+        messages.push_back(error + PTree::joinPaths(src.getSelfPath(), set.paths[i]));
+        ok = false;
+      }
+    }
+  };
+
+  // kept sorted by path, the order in which records are visited
+  std::vector<std::string> paths;
+  std::vector<boost::shared_ptr<TField const> > fields;
+};
+
+} // namespace mxprops
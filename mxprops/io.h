@@ -31,6 +31,8 @@ either expressed or implied, of copyright holders.
 #pragma once
 #include <json-cpp/forwards.h>
 #include "mxprops.h"
+#include "schema.h"
+#include <iosfwd>
 
 
 namespace mxprops {
@@ -40,14 +42,97 @@ bool load_from_command_line(mxprops::PTree::Ref const& dst,
                             int argc,
                             char const* argv[]);
 
+// all values are written in one batch, or none on error
 bool load_from_json(mxprops::PTree::Ref const& dst,
                     std::vector<std::string> & messages,
                     Json::Value const& doc);
 
+// key=value lines, blank lines and # comments; the file is mapped rather
+// than read, and all values are written in one batch, or none on error
+bool load_from_properties_file(mxprops::PTree::Ref const& dst,
+                               std::vector<std::string> & messages,
+                               std::string const& filename);
+
 bool load_from_json_file(mxprops::PTree::Ref const& dst,
                          std::vector<std::string> & messages,
                          std::string const& filename);
 
+// Parses the files in parallel, on at most one thread per core, then
+// applies them in the given order, so later files override earlier ones as
+// with successive load_from_json_file() calls; stops at the first file that
+// fails, which is not applied.
+bool load_from_json_files(mxprops::PTree::Ref const& dst,
+                          std::vector<std::string> & messages,
+                          std::vector<std::string> const& filenames);
+
+// the same, checked by the schema before anything is written: dst is left
+// as it was if loading fails or any declared path is bad, see Schema::apply
+bool load_from_command_line(mxprops::PTree::Ref const& dst,
+                            std::vector<std::string> & messages,
+                            int argc,
+                            char const* argv[],
+                            Schema const& schema);
+
+bool load_from_json(mxprops::PTree::Ref const& dst,
+                    std::vector<std::string> & messages,
+                    Json::Value const& doc,
+                    Schema const& schema);
+
+bool load_from_json_file(mxprops::PTree::Ref const& dst,
+                         std::vector<std::string> & messages,
+                         std::string const& filename,
+                         Schema const& schema);
+
+// A batch, such as a patch from PTree::diff, as a JSON array for sending
+// to another process:
+//   [{"path": "a.b", "value": "1"}, {"path": "c", "elements": ["1", "2"]},
+//    {"path": "d", "undefined": true}, {"path": "e", "erased": true}]
+// Only values travel; path metadata stays with the sending tree.
+void batch_to_json(mxprops::PTree::Batch const& batch,
+                   Json::Value & doc);
+
+bool batch_from_json(Json::Value const& doc,
+                     mxprops::PTree::Batch & batch,
+                     std::vector<std::string> & messages);
+
+// Write the defined records of src, keys relative to src, without building
+// a document: as nested JSON that load_from_json reads back, or as flat
+// key=value lines for load_from_command_line style loading.  Dotted paths
+// become nested objects, and objects keyed 0..n-1 become arrays; a value
+// at a node that also has children is written under the key "".  Numbers
+// are written bare only if they read back as the same string.  In the
+// flat form, array elements are written as index keys "name.0", "name.1".
+// Keys with an empty segment, like "a." or "a..b", fit neither form and
+// fail the export with a message.  The tree is walked node by node under
+// its read lock while writing, so for a slow sink, export a frozen tree or
+// a copy.
+bool save_to_json(mxprops::PTree::ConstRef const& src,
+                  std::vector<std::string> & messages,
+                  std::ostream & out);
+
+bool save_to_json_file(mxprops::PTree::ConstRef const& src,
+                       std::vector<std::string> & messages,
+                       std::string const& filename);
+
+bool save_to_properties(mxprops::PTree::ConstRef const& src,
+                        std::vector<std::string> & messages,
+                        std::ostream & out);
+
+bool save_to_properties_file(mxprops::PTree::ConstRef const& src,
+                             std::vector<std::string> & messages,
+                             std::string const& filename);
+
+#if defined(__unix__) || defined(__APPLE__)
+// to an open file descriptor, e.g. a pipe or socket
+bool save_to_json(mxprops::PTree::ConstRef const& src,
+                  std::vector<std::string> & messages,
+                  int fd);
+
+bool save_to_properties(mxprops::PTree::ConstRef const& src,
+                        std::vector<std::string> & messages,
+                        int fd);
+#endif
+
 void init_settings_from_command_line(mxprops::PTree::Ref const& dst,
                                      int argc,
                                      char const* argv[]);
@@ -0,0 +1,69 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+#include "mxprops.h"
+#include <boost/scoped_ptr.hpp>
+
+
+namespace mxprops {
+
+// A JSON file used in place through a read-only memory mapping, for configs
+// too large to load when a process reads only part of them:
+//
+//   tree.attach(PTree::PSource(new JsonSource("models.json")), "models");
+//
+// Opening the file only scans it for the offsets of its objects and
+// arrays.  The members of an object or array become records the first time
+// a path below it is looked up, so memory grows with what is read.  Records
+// are the same as load_from_json_file() would write.
+class JsonSource : public PTree::Source
+{
+public:
+  // throws std::runtime_error if the file cannot be mapped or its brackets
+  // and strings do not balance; other syntax errors are thrown by the
+  // lookup that reaches them
+  explicit JsonSource(std::string const& filename);
+  ~JsonSource();
+
+  // records materialized so far
+  size_t getLoadedCount() const;
+
+  virtual bool find(std::string const& path, PTree::Record & r) const;
+  virtual void listRecords(std::string const& prefix,
+                           std::vector<PTree::Source::entry_t> & result) const;
+
+private:
+  struct Impl;
+  boost::scoped_ptr<Impl> impl;
+};
+
+}
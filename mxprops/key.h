@@ -0,0 +1,85 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+#include <string>
+
+#if __cplusplus >= 201103L
+# define MXPROPS_CONSTEXPR constexpr
+#else
+# define MXPROPS_CONSTEXPR
+#endif
+
+
+namespace mxprops {
+
+// FNV-1a of n chars continuing from h, the same as PTree::hashPath; a
+// constant expression under C++11
+inline MXPROPS_CONSTEXPR boost::uint64_t hashLiteral(char const* p, size_t n,
+                                                     boost::uint64_t h = UINT64_C(14695981039346656037))
+{
+  return n == 0 ? h : hashLiteral(p + 1, n - 1, (h ^ static_cast<unsigned char>(*p)) * UINT64_C(1099511628211));
+}
+
+// A property path known at compile time, with its hash and value type:
+//
+//   static MXPROPS_CONSTEXPR Key<int> const fps("camera.fps");
+//   int v = ref.get(fps);
+//
+// Frozen trees look such keys up by the precomputed hash without building
+// a string; otherwise they behave like the literal path.
+template <typename TData>
+class Key
+{
+public:
+  typedef TData value_type;
+
+  template <size_t N>
+  explicit MXPROPS_CONSTEXPR Key(char const (&path)[N])
+  : path(path), size(N - 1), hash(hashLiteral(path, N - 1))
+  { }
+
+  MXPROPS_CONSTEXPR char const* getPath() const { return path; }
+  MXPROPS_CONSTEXPR size_t getSize() const { return size; }
+  MXPROPS_CONSTEXPR boost::uint64_t getHash() const { return hash; }
+
+  std::string toString() const { return std::string(path, size); }
+
+private:
+  char const* path;
+  size_t size;
+  boost::uint64_t hash;
+};
+
+} // namespace mxprops
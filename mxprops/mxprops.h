@@ -36,12 +36,23 @@ either expressed or implied, of copyright holders.
 #include <boost/thread.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <cstdio>
+#include <typeinfo>
 #include <vector>
 #include <map>
+#include <set>
 #include <utility>
+#include <algorithm>
 #include <mxprops/pathprop.h>
+#include <mxprops/arena.h>
+#include <mxprops/convert.h>
+#include <mxprops/key.h>
 
 namespace mxprops {
 
@@ -67,8 +78,11 @@ public:
   class Record
   {
   public:
+    typedef std::vector<std::string> elements_t;
+
     Record()
-    : defined(false)
+    : version(0),
+      defined(false)
     { }
 
     std::string const& getValue() const { return value; }
@@ -77,15 +91,89 @@ public:
     {
       value = v;
       defined = true;
+      elements.reset();
+      typed.reset();
     }
 
     void setValue(std::string const& v, PathPropData const& pd)
     {
       setValue(v);
-      pathData = pd;
+      pathData.reset(new PathPropData(pd));
+    }
+
+    // array values are kept as a single record with contiguous elements;
+    // "name.3" still reads the element through the owning PTree
+    void setElements(elements_t const& v)
+    {
+      value.clear();
+      defined = true;
+      elements.reset(new elements_t(v));
+      typed.reset();
+    }
+
+    // Numbers read by the loaders: the value is formatted as set_as does,
+    // and kept as int, if in range, and as double, so that get_as of those
+    // types does not parse it.
+    void setInteger(boost::int64_t v)
+    {
+      set_as<boost::int64_t>(v);
+      if (v >= std::numeric_limits<int>::min() && v <= std::numeric_limits<int>::max())
+        typed.reset(new TypedPair<int, double>(static_cast<int>(v), static_cast<double>(v)));
+      else
+        typed.reset(new TypedPair<boost::int64_t, double>(v, static_cast<double>(v)));
+    }
+
+    void setReal(double v)
+    {
+      set_typed<double>(v);
+    }
+
+    // As setElements, for arrays read by the loaders: the elements are also
+    // kept converted, to int and double if all are integers or to double if
+    // all are numbers, so that get_array_ptr of those types does not parse
+    // them on every call.
+    void setElementsConverted(elements_t const& v)
+    {
+      setElements(v);
+      std::vector<int> ints;
+      std::vector<double> doubles;
+      ints.reserve(v.size());
+      doubles.reserve(v.size());
+      for (size_t i = 0; i < v.size(); ++i)
+      {
+        boost::optional<int> const n = Converter<int>::parse(v[i]);
+        if (!n)
+          break;
+        ints.push_back(*n);
+        doubles.push_back(*n);
+      }
+      if (ints.size() == v.size())
+      {
+        typed.reset(new TypedPair<std::vector<int>, std::vector<double> >(ints, doubles));
+        return;
+      }
+      for (size_t i = ints.size(); i < v.size(); ++i)
+      {
+        boost::optional<double> const d = Converter<double>::parse(v[i]);
+        if (!d)
+          return;
+        doubles.push_back(*d);
+      }
+      typed.reset(new TypedAs<std::vector<double> >(doubles));
     }
 
     bool isDefined() const { return defined; }
+    bool isArray() const { return elements.get() != 0; }
+
+    // the tree version of the last write of the record, 0 if never written
+    boost::uint64_t getVersion() const { return version; }
+
+    // empty for non-array records; shared between copies, so no copy is made
+    elements_t const& getElements() const
+    {
+      static elements_t const empty;
+      return elements ? *elements : empty;
+    }
 
     template <typename TData>
     boost::optional<TData> get_as(bool *getDefined = 0) const
@@ -93,96 +181,1890 @@ public:
       if (getDefined)
         *getDefined = defined;
 
-      if (!defined)
+      if (!defined || elements)
         return boost::optional<TData>();
-      typedef typename boost::property_tree::translator_between<std::string, TData>::type Tr;
-      return Tr().get_value(value);
+      TData const* converted = typed ? static_cast<TData const*>(typed->as(typeid(TData))) : 0;
+      if (converted)
+        return *converted;
+      return Converter<TData>::parse(value);
     }
 
     template <typename TData>
     void set_as(TData const& d)
     {
-      typedef typename boost::property_tree::translator_between<std::string, TData>::type Tr;
-      boost::optional<std::string> strTranslated = Tr().put_value(d);
-      defined = strTranslated;
+      boost::optional<std::string> strTranslated = Converter<TData>::format(d);
+      defined = strTranslated.is_initialized();
       value = strTranslated.get_value_or("<invalid>");
+      elements.reset();
+      typed.reset();
+    }
+
+    // as set_as, but also keeps the value itself, so that get_as<TData>
+    // returns it without parsing; any other assignment drops it
+    template <typename TData>
+    void set_typed(TData const& d)
+    {
+      set_as<TData>(d);
+      if (defined)
+        typed.reset(new TypedAs<TData>(d));
+    }
+
+    // The converted elements, 0 if undefined, not an array or malformed.
+    // Arrays written with set_array_as<TData> or setElementsConverted keep
+    // the converted vector, and the result shares it with the record, as do
+    // strings with the elements themselves; others are parsed on each call.
+    template <typename TData>
+    boost::shared_ptr<std::vector<TData> const> get_array_ptr(bool *getDefined = 0) const
+    {
+      typedef std::vector<TData> vector_t;
+      if (getDefined)
+        *getDefined = defined;
+
+      if (!defined || !elements)
+        return boost::shared_ptr<vector_t const>();
+      vector_t const* converted = typed ? static_cast<vector_t const*>(typed->as(typeid(vector_t))) : 0;
+      if (converted)
+        return boost::shared_ptr<vector_t const>(typed, converted);
+      boost::shared_ptr<vector_t const> const same = sharedElements(elements, static_cast<vector_t *>(0));
+      if (same)
+        return same;
+      boost::shared_ptr<vector_t> result(new vector_t());
+      result->reserve(elements->size());
+      for (size_t i = 0; i < elements->size(); ++i)
+      {
+        boost::optional<TData> const v = Converter<TData>::parse((*elements)[i]);
+        if (!v)
+          return boost::shared_ptr<vector_t const>();
+        result->push_back(*v);
+      }
+      return result;
+    }
+
+    template <typename TData>
+    boost::optional<std::vector<TData> > get_array_as(bool *getDefined = 0) const
+    {
+      boost::shared_ptr<std::vector<TData> const> const v = get_array_ptr<TData>(getDefined);
+      if (!v)
+        return boost::optional<std::vector<TData> >();
+      return *v;
+    }
+
+    template <typename TData>
+    void set_array_as(std::vector<TData> const& d)
+    {
+      boost::shared_ptr<elements_t> v(new elements_t());
+      v->reserve(d.size());
+      defined = true;
+      for (size_t i = 0; i < d.size(); ++i)
+      {
+        boost::optional<std::string> const strTranslated = Converter<TData>::format(d[i]);
+        defined = defined && strTranslated;
+        v->push_back(strTranslated.get_value_or("<invalid>"));
+      }
+      value.clear();
+      elements = v;
+      typed.reset();
+      if (defined)
+        typed.reset(new TypedAs<std::vector<TData> >(d));
     }
 
     void undefine()
     {
       defined = false;
+      elements.reset();
+      typed.reset();
     }
 
+    bool hasPathData() const { return pathData.get() != 0; }
+
     PathPropData const& getPathData() const
     {
-      return pathData;
+      static PathPropData const none;
+      return pathData ? *pathData : none;
     }
 
   private:
+    friend class PTree;
+
+    // replaces the value, keeping the path metadata, as set_as does
+    void assignValue(Record const& r)
+    {
+      value = r.value;
+      elements = r.elements;
+      typed = r.typed;
+      defined = r.defined;
+    }
+
+    bool sameValue(Record const& r) const
+    {
+      return defined == r.defined && value == r.value
+          && (elements == r.elements || (elements && r.elements && *elements == *r.elements));
+    }
+
+    // a value kept converted, in one or more types
+    class Typed
+    {
+    public:
+      virtual ~Typed() { }
+
+      // the value as type t, or 0 if not kept as t
+      virtual void const* as(std::type_info const& t) const = 0;
+    };
+
+    template <typename TData>
+    class TypedAs : public Typed
+    {
+    public:
+      explicit TypedAs(TData const& value)
+      : value(value)
+      { }
+
+      virtual void const* as(std::type_info const& t) const
+      {
+        return t == typeid(TData) ? &value : 0;
+      }
+
+      TData const value;
+    };
+
+    template <typename TFirst, typename TSecond>
+    class TypedPair : public Typed
+    {
+    public:
+      TypedPair(TFirst const& first, TSecond const& second)
+      : first(first), second(second)
+      { }
+
+      virtual void const* as(std::type_info const& t) const
+      {
+        if (t == typeid(TFirst))
+          return &first;
+        return t == typeid(TSecond) ? &second : 0;
+      }
+
+      TFirst const first;
+      TSecond const second;
+    };
+
+    // the elements themselves for std::vector<std::string>, none otherwise
+    static boost::shared_ptr<elements_t const>
+    sharedElements(boost::shared_ptr<elements_t const> const& e, elements_t *)
+    {
+      return e;
+    }
+
+    template <typename TVector>
+    static boost::shared_ptr<TVector const>
+    sharedElements(boost::shared_ptr<elements_t const> const&, TVector *)
+    {
+      return boost::shared_ptr<TVector const>();
+    }
+
+    // short values stay within the string itself (small string optimization);
+    // path metadata, array elements and typed values are rare, so they are
+    // kept out of line and shared between copies of the record
     std::string value;
+    boost::shared_ptr<PathPropData const> pathData;
+    boost::shared_ptr<elements_t const> elements;
+    boost::shared_ptr<Typed const> typed;
+    boost::uint64_t version;
     bool defined;
-    PathPropData pathData;
   };
 
-public:
-  PTree()
-  { }
-
-  class Ref;
-  class ConstRef;
+  struct MemoryUsage
+  {
+    size_t records;
+    size_t definedRecords;
+    size_t arrayRecords;
+    size_t pathDataRecords;
+    size_t keyBytes;      // heap bytes of keys not stored inline
+    size_t valueBytes;    // heap bytes of values and array elements
+    size_t totalBytes;    // including records, map nodes and indices
+
+    MemoryUsage()
+    : records(0), definedRecords(0), arrayRecords(0), pathDataRecords(0),
+      keyBytes(0), valueBytes(0), totalBytes(0)
+    { }
+  };
+
+  // Read-only store of records consulted for paths the tree itself holds
+  // no record of; writes always go to the tree and shadow the source.
+  class Source : private boost::noncopyable
+  {
+  public:
+    typedef std::pair<std::string, Record> entry_t;
+
+    virtual ~Source() { }
+
+    virtual bool find(std::string const& path, Record & r) const = 0;
+
+    // appends the record at prefix and all records below it, in key order
+    virtual void listRecords(std::string const& prefix,
+                             std::vector<entry_t> & result) const = 0;
+
+    // changes whenever the contents change; immutable sources keep 0
+    virtual boost::uint64_t getVersion() const { return 0; }
+  };
+
+  typedef boost::shared_ptr<Source const> PSource;
+
+  class Layer;
+
+  // Writes collected to be applied in order under a single lock, with a
+  // single change notification per listener; paths are relative to the Ref
+  // the batch is applied to.
+  class Batch
+  {
+  public:
+    enum Op
+    {
+      ASSIGN,   // replace the whole record
+      UPDATE,   // replace the value, keep the path metadata
+      UNDEFINE,
+      ERASE     // remove the record and all records below it
+    };
+
+    struct Entry
+    {
+      std::string path;
+      Record record;
+      Op op;
+
+      Entry(std::string const& path, Record const& record, Op op)
+      : path(path), record(record), op(op)
+      { }
+    };
+
+    typedef std::vector<Entry> entries_t;
+
+    void setRecord(std::string const& path, Record const& r)
+    {
+      entries.push_back(Entry(path, r, ASSIGN));
+    }
+
+    template <typename TData>
+    void set(std::string const& path, TData const& value)
+    {
+      entries.push_back(Entry(path, Record(), UPDATE));
+      entries.back().record.set_as<TData>(value);
+    }
+
+    template <typename TData>
+    void setTyped(std::string const& path, TData const& value)
+    {
+      entries.push_back(Entry(path, Record(), UPDATE));
+      entries.back().record.set_typed<TData>(value);
+    }
+
+    template <typename TData>
+    void setArray(std::string const& path, std::vector<TData> const& values)
+    {
+      entries.push_back(Entry(path, Record(), UPDATE));
+      entries.back().record.set_array_as<TData>(values);
+    }
+
+    void undefine(std::string const& path)
+    {
+      entries.push_back(Entry(path, Record(), UNDEFINE));
+    }
+
+    void erase(std::string const& path)
+    {
+      entries.push_back(Entry(path, Record(), ERASE));
+    }
+
+    entries_t const& getEntries() const { return entries; }
+    bool empty() const { return entries.empty(); }
+    size_t size() const { return entries.size(); }
+    void clear() { entries.clear(); }
+
+  private:
+    entries_t entries;
+  };
+
+  // Receives the records changed by a write, after the tree lock is released
+  // and on the writing thread.  Paths are full; removed values come as
+  // undefined records.  Once removeListener returned, the listener is not
+  // called again, though a call already running on another thread may still
+  // be in progress.
+  class Listener : private boost::noncopyable
+  {
+  public:
+    virtual ~Listener() { }
+
+    virtual void onChange(std::string const& prefix,
+                          std::vector<Source::entry_t> const& changes) = 0;
+  };
+
+  typedef boost::shared_ptr<Listener> PListener;
+
+  struct AccessStats
+  {
+    boost::uint64_t reads;
+    boost::posix_time::ptime lastRead; // UTC
+
+    AccessStats()
+    : reads(0)
+    { }
+  };
+
+  typedef std::map<std::string, AccessStats> access_stats_t;
+
+  // Acquisitions of the tree lock, split by the kind of operation taking it.
+  // With Options::sharedReads, read waits are only those behind a writer.
+  // Times are in microseconds; frozen trees take no lock for reading.
+  struct LockStats
+  {
+    enum { HISTOGRAM_SIZE = 20 };
+
+    struct Path
+    {
+      boost::uint64_t acquisitions;
+      boost::uint64_t contended;    // had to wait for another thread
+      boost::uint64_t waitTotal;
+      boost::uint64_t waitMax;
+      boost::uint64_t holdMax;
+      boost::uint64_t waiting;      // threads blocked on the lock at the time
+      // waits of 0us, then [2^(i-1), 2^i) for i > 0; the last is open ended
+      boost::uint64_t waitHistogram[HISTOGRAM_SIZE];
+
+      Path()
+      : acquisitions(0), contended(0), waitTotal(0), waitMax(0), holdMax(0), waiting(0)
+      {
+        std::fill(waitHistogram, waitHistogram + HISTOGRAM_SIZE, 0);
+      }
+
+      std::string toJson() const
+      {
+        std::string r = "{\"acquisitions\": " + boost::lexical_cast<std::string>(acquisitions)
+                      + ", \"contended\": " + boost::lexical_cast<std::string>(contended)
+                      + ", \"wait_us_total\": " + boost::lexical_cast<std::string>(waitTotal)
+                      + ", \"wait_us_max\": " + boost::lexical_cast<std::string>(waitMax)
+                      + ", \"hold_us_max\": " + boost::lexical_cast<std::string>(holdMax)
+                      + ", \"waiting\": " + boost::lexical_cast<std::string>(waiting)
+                      + ", \"wait_us_histogram\": [";
+        for (size_t i = 0; i < HISTOGRAM_SIZE; ++i)
+          r += (i ? ", " : "") + boost::lexical_cast<std::string>(waitHistogram[i]);
+        return r + "]}";
+      }
+    };
+
+    Path read;
+    Path write;
+
+    std::string toJson() const
+    {
+      return "{\"read\": " + read.toJson() + ", \"write\": " + write.toJson() + "}";
+    }
+  };
+
+  struct Options
+  {
+    // Allocate the map nodes, which hold the records, from an arena in chunks
+    // of this size, reused by the next load after clear(); 0 to use the heap.
+    // Keys and values too long to be stored inline, and array elements and
+    // path data, stay on the heap, and clear() still destroys each record.
+    size_t arenaChunkSize;
+
+    // Let readers hold the tree lock together instead of one at a time.
+    // Each acquisition still passes the lock's internal mutex, so readers
+    // contend briefly, and costs more than a plain mutex; it pays off only
+    // with several threads reading at once.  There is one lock per tree, not
+    // one per subtree: a write anywhere holds off every reader.  The
+    // get-shared-disjoint lines of mxprops_bench measure what that costs.
+    bool sharedReads;
+
+    Options()
+    : arenaChunkSize(0),
+      sharedReads(false)
+    { }
+  };
+
+public:
+  PTree()
+  : frozen(0),
+    lockTiming(false),
+    lastListenerId(0),
+    version(0),
+    id(nextId()),
+    cacheEpoch(0),
+    tracking(false),
+    readCaching(false),
+    sharedReads(false)
+  {
+    clearPathStamps();
+  }
+
+  explicit PTree(Options const& options)
+  : arena(options.arenaChunkSize ? new Arena(options.arenaChunkSize) : 0),
+    propMap(std::less<std::string>(), propmap_t::allocator_type(arena.get())),
+    frozen(0),
+    lockTiming(false),
+    lastListenerId(0),
+    version(0),
+    id(nextId()),
+    cacheEpoch(0),
+    tracking(false),
+    readCaching(false),
+    sharedReads(options.sharedReads)
+  {
+    clearPathStamps();
+  }
+
+  class Ref;
+  class ConstRef;
+
+  // Read access to the nodes of a subtree, for exporters that walk it depth
+  // first instead of copying it; only valid inside ConstRef::visitNodes.
+  // Paths are relative to the ref, and only defined records count.
+  class NodeView : private boost::noncopyable
+  {
+  public:
+    // the record at path, or 0
+    Record const* find(std::string const& path) const;
+
+    // the distinct next segments of the records below path, sorted; keys
+    // with an empty next segment, like "a." or "a..b" below "a", are left
+    // out, and false tells that there were some
+    bool listChildren(std::string const& path, std::vector<std::string> & segments) const;
+
+  private:
+    friend class ConstRef;
+
+    NodeView(PTree const& tree, std::string const& selfPath,
+             std::vector<Source::entry_t> const* entries)
+    : tree(tree), selfPath(selfPath), entries(entries)
+    { }
+
+    PTree const& tree;
+    std::string const& selfPath;
+    std::vector<Source::entry_t> const* entries; // sorted by key; 0 for propMap
+  };
+
+  ConstRef root(const std::string &id) const;
+  Ref      root(const std::string &id);
+
+  static std::string joinPaths(const std::string &p1, const std::string &p2)
+  {
+    if (p1.empty())
+      return p2;
+    if (p2.empty())
+      return p1;
+    return p1 + "." + p2;
+  }
+
+  static bool isSimplePath(const std::string &p)
+  {
+    return !p.empty() && p.find('.') == std::string::npos;
+  }
+
+  static std::string splitFirst(const std::string &p)
+  {
+    size_t const pos = p.find('.');
+    if (pos == std::string::npos)
+      return p;
+    else
+      return p.substr(0, pos);
+  }
+
+  // FNV-1a; seed continues the hash of a preceding string
+  static boost::uint64_t hashPath(char const* p, size_t size,
+                                  boost::uint64_t seed = UINT64_C(14695981039346656037))
+  {
+    boost::uint64_t h = seed;
+    for (size_t i = 0; i < size; ++i)
+    {
+      h ^= static_cast<unsigned char>(p[i]);
+      h *= UINT64_C(1099511628211);
+    }
+    return h;
+  }
+
+  // drops the tree's own records; attached sources stay
+  void clear()
+  {
+    LockGuard g(*this, lockCounters.write);
+    checkNotFrozen("");
+    propMap.clear();
+    if (arena)
+      arena->reset();
+    ++cacheEpoch;
+    erasures.push_back(std::make_pair(++version, std::string()));
+  }
+
+  // Attaches a read-only source (e.g. a mapped snapshot, or another tree via
+  // Layer) below the tree's own records and above the sources attached
+  // before it, so that "defaults <- files <- command line" is attached in
+  // that order.  Nothing is copied until a path is written.  The name is
+  // reported by ConstRef::getOrigin.
+  void attach(PSource const& src, std::string const& name = "")
+  {
+    LockGuard g(*this, lockCounters.write);
+    checkNotFrozen("");
+    if (src)
+      sources.insert(sources.begin(), Attached(name, src));
+    resolved.clear();
+    ++cacheEpoch;
+    ++version;
+  }
+
+  void detach()
+  {
+    LockGuard g(*this, lockCounters.write);
+    checkNotFrozen("");
+    sources.clear();
+    resolved.clear();
+    ++cacheEpoch;
+    ++version;
+  }
+
+  // Shares another tree as a layer; layers must not form a cycle.
+  static PSource layer(boost::shared_ptr<PTree const> const& tree);
+
+  // Moves all defined records into an immutable hashed table.  From then on
+  // reads take no lock and any write throws PropsError; there is no way back.
+  void freeze()
+  {
+    LockGuard g(*this, lockCounters.write);
+    if (frozen.load(boost::memory_order_relaxed))
+      return;
+
+    boost::scoped_ptr<FrozenTable> table(new FrozenTable());
+    FrozenTable::Builder builder(*table);
+    visitSubtree("", builder);
+    table->buildIndex();
+
+    propMap.clear();
+    if (arena)
+      arena->reset();
+    sources.clear();
+    resolved.clear();
+    ++cacheEpoch;
+    frozenStorage.swap(table);
+    frozen.store(frozenStorage.get(), boost::memory_order_release);
+  }
+
+  bool isFrozen() const
+  {
+    return frozen.load(boost::memory_order_acquire) != 0;
+  }
+
+  // Notifies l of every write that changes a value at prefix or below it;
+  // writes of an unchanged value are not reported.
+  size_t addListener(std::string const& prefix, PListener const& l)
+  {
+    LockGuard g(*this, lockCounters.write);
+    Subscription & s = listeners[++lastListenerId];
+    s.prefix = prefix;
+    s.listener = l;
+    s.alive.reset(new boost::atomic<bool>(true));
+    return lastListenerId;
+  }
+
+  void removeListener(size_t id)
+  {
+    LockGuard g(*this, lockCounters.write);
+    listeners_t::iterator it = listeners.find(id);
+    if (it == listeners.end())
+      return;
+    it->second.alive->store(false, boost::memory_order_release);
+    listeners.erase(it);
+  }
+
+  // Counts the reads made through refs, per full path.  The counters are kept
+  // per thread and only merged when queried; while tracking is off, a read
+  // costs one relaxed atomic load more.
+  void setAccessTracking(bool enable)
+  {
+    tracking.store(enable, boost::memory_order_relaxed);
+  }
+
+  bool isAccessTracking() const
+  {
+    return tracking.load(boost::memory_order_relaxed);
+  }
+
+  // Keeps the results of the last few hundred typed gets per thread, so a
+  // repeated get of the same path and type is a lookup in memory of the
+  // calling thread alone, with no lock taken.  A result lasts until a write
+  // to a path with the same last name, array indices aside (or a name in
+  // the same hash stripe), or until a subtree is erased or moved, the tree
+  // cleared or its sources changed.  Not used while access tracking is on;
+  // trees with attached sources are not cached, since sources change
+  // without a write to the tree.
+  void setReadCache(bool enable)
+  {
+    readCaching.store(enable, boost::memory_order_relaxed);
+  }
+
+  bool isReadCache() const
+  {
+    return readCaching.load(boost::memory_order_relaxed);
+  }
+
+  access_stats_t getAccessStats() const
+  {
+    access_stats_t result;
+    boost::lock_guard<boost::mutex> g(logsMutex);
+    for (size_t i = 0; i < readLogs.size(); ++i)
+    {
+      boost::lock_guard<boost::mutex> lg(readLogs[i]->mutex);
+      for (access_stats_t::const_iterator it = readLogs[i]->reads.begin(); it != readLogs[i]->reads.end(); ++it)
+      {
+        AccessStats & s = result[it->first];
+        s.reads += it->second.reads;
+        if (s.lastRead.is_special() || s.lastRead < it->second.lastRead)
+          s.lastRead = it->second.lastRead;
+      }
+    }
+    return result;
+  }
+
+  // Defined records not read since tracking was enabled or last reset; an
+  // array counts as read when any of its elements is.
+  void listUnreadKeys(std::vector<std::string> & result) const
+  {
+    access_stats_t const stats = getAccessStats();
+    std::set<std::string> read;
+    for (access_stats_t::const_iterator it = stats.begin(); it != stats.end(); ++it)
+    {
+      read.insert(it->first);
+      size_t const pos = it->first.rfind('.');
+      if (pos != std::string::npos && pos + 1 < it->first.size()
+          && it->first.find_first_not_of("0123456789", pos + 1) == std::string::npos)
+        read.insert(it->first.substr(0, pos));
+    }
+
+    ReadGuard g(*this);
+    UnreadCollector c(result, read);
+    visitSubtree("", c);
+  }
+
+  void resetAccessStats()
+  {
+    boost::lock_guard<boost::mutex> g(logsMutex);
+    for (size_t i = 0; i < readLogs.size(); ++i)
+    {
+      boost::lock_guard<boost::mutex> lg(readLogs[i]->mutex);
+      readLogs[i]->reads.clear();
+    }
+  }
+
+  // Incremented by every write; records remember the version that last wrote
+  // them, see ConstRef::getChangesSince.
+  boost::uint64_t getVersion() const
+  {
+    return version.load(boost::memory_order_acquire);
+  }
+
+  // Appends to patch what turns the records under from into those under to:
+  // records added or changed, and undefines for records missing from to.
+  // Paths are relative, so the patch applies to any ref holding what from
+  // holds, typically on another tree.
+  static void diff(ConstRef const& from, ConstRef const& to, Batch & patch);
+
+  // Counts and times the acquisitions of the tree mutex; while disabled, a
+  // lock costs one relaxed atomic load more.
+  void setLockStats(bool enable)
+  {
+    lockTiming.store(enable, boost::memory_order_relaxed);
+  }
+
+  // The counters are read one by one while other threads may update them,
+  // so a snapshot taken under load need not add up exactly.
+  LockStats getLockStats() const
+  {
+    LockStats r;
+    lockCounters.read.get(r.read);
+    lockCounters.write.get(r.write);
+    return r;
+  }
+
+  void resetLockStats()
+  {
+    lockCounters.read.reset();
+    lockCounters.write.reset();
+  }
+
+  // Approximate heap footprint of the records held by the tree itself;
+  // an attached source is mapped, not counted.
+  MemoryUsage getMemoryUsage() const
+  {
+    ReadGuard g(*this);
+    MemoryUsage u;
+    size_t const nodeOverhead = 4 * sizeof(void *); // std::map node links and color
+    FrozenTable const* table = frozen.load(boost::memory_order_relaxed);
+    if (table)
+    {
+      for (size_t i = 0; i < table->entries.size(); ++i)
+        addUsage(u, table->entries[i].first, table->entries[i].second);
+      u.totalBytes += table->entries.capacity() * sizeof(Source::entry_t)
+                    + table->indexBytes();
+    }
+    else
+    {
+      for (propmap_t::const_iterator it = propMap.begin(); it != propMap.end(); ++it)
+        addUsage(u, it->first, it->second);
+      if (arena)
+        u.totalBytes += arena->getReservedBytes();
+      else
+        u.totalBytes += propMap.size() * (nodeOverhead + sizeof(propmap_t::value_type));
+    }
+    u.totalBytes += u.keyBytes + u.valueBytes;
+    return u;
+  }
+
+
+private:
+
+  typedef std::map<std::string, Record, std::less<std::string>,
+                   ArenaAllocator<std::pair<std::string const, Record> > > propmap_t;
+
+  boost::scoped_ptr<Arena> arena;
+  propmap_t propMap;
+
+  // Records sorted by key, as in propMap, plus an open-addressing hash index
+  class FrozenTable
+  {
+  public:
+    typedef std::vector<Source::entry_t> entries_t;
+
+    struct Builder
+    {
+      FrozenTable & table;
+
+      Builder(FrozenTable & table)
+      : table(table)
+      { }
+
+      void operator () (std::string const& key, Record const& r)
+      {
+        if (r.isDefined())
+          table.entries.push_back(Source::entry_t(key, r));
+      }
+    };
+
+    void buildIndex()
+    {
+      size_t size = 16;
+      while (size < entries.size() * 2)
+        size *= 2;
+      mask = size - 1;
+      slots.assign(size, 0);
+      hashes.resize(entries.size());
+      for (size_t i = 0; i < entries.size(); ++i)
+      {
+        std::string const& key = entries[i].first;
+        hashes[i] = hashPath(key.data(), key.size());
+        size_t slot = hashes[i] & mask;
+        while (slots[slot] != 0)
+          slot = (slot + 1) & mask;
+        slots[slot] = static_cast<boost::uint32_t>(i + 1);
+      }
+    }
+
+    Record const* find(std::string const& path, boost::uint64_t hash) const
+    {
+      for (size_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask)
+      {
+        size_t const i = slots[slot] - 1;
+        if (hashes[i] == hash && entries[i].first == path)
+          return &entries[i].second;
+      }
+      return 0;
+    }
+
+    Record const* find(std::string const& path) const
+    {
+      return find(path, hashPath(path.data(), path.size()));
+    }
+
+    // the record at prefix.path, for a path of n chars not 0-terminated
+    Record const* find(std::string const& prefix, char const* path, size_t n,
+                       boost::uint64_t hash) const
+    {
+      size_t const offset = prefix.empty() ? 0 : prefix.size() + 1;
+      for (size_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask)
+      {
+        std::string const& key = entries[slots[slot] - 1].first;
+        if (hashes[slots[slot] - 1] == hash && key.size() == offset + n
+            && key.compare(offset, n, path, n) == 0
+            && (!offset || (key.compare(0, prefix.size(), prefix) == 0 && key[prefix.size()] == '.')))
+          return &entries[slots[slot] - 1].second;
+      }
+      return 0;
+    }
+
+    entries_t::const_iterator lowerBound(std::string const& key) const
+    {
+      return lowerBoundIn(entries, key);
+    }
+
+    size_t indexBytes() const
+    {
+      return slots.capacity() * sizeof(boost::uint32_t)
+           + hashes.capacity() * sizeof(boost::uint64_t);
+    }
+
+    entries_t entries;
+
+  private:
+    std::vector<boost::uint32_t> slots; // entry index + 1, 0 for an empty slot
+    std::vector<boost::uint64_t> hashes;
+    size_t mask;
+  };
+
+  struct EntryLess
+  {
+    bool operator () (Source::entry_t const& e, std::string const& key) const
+    {
+      return e.first < key;
+    }
+  };
+
+  // lookups shared by the sorted record sequences: propMap, and the entries
+  // of a frozen table or of a merged copy
+  static propmap_t::const_iterator lowerBoundIn(propmap_t const& records, std::string const& key)
+  {
+    return records.lower_bound(key);
+  }
+
+  static std::vector<Source::entry_t>::const_iterator
+  lowerBoundIn(std::vector<Source::entry_t> const& records, std::string const& key)
+  {
+    return std::lower_bound(records.begin(), records.end(), key, EntryLess());
+  }
+
+  template <typename TRecords>
+  static Record const* findDefined(TRecords const& records, std::string const& key)
+  {
+    typename TRecords::const_iterator const it = lowerBoundIn(records, key);
+    if (it == records.end() || it->first != key || !it->second.isDefined())
+      return 0;
+    return &it->second;
+  }
+
+  // Skips each "segment.*" range with one lookup.  Siblings such as
+  // "segment-b" sort between "segment" and "segment.*", so a segment may be
+  // met twice; the set keeps it once.  False if defined records with an
+  // empty next segment were skipped; the root's own record "" is not one.
+  template <typename TRecords>
+  static bool listChildSegments(TRecords const& records, std::string const& path,
+                                std::vector<std::string> & segments)
+  {
+    std::string const children = path.empty() ? path : path + ".";
+    std::set<std::string> found;
+    bool complete = true;
+    typename TRecords::const_iterator it = lowerBoundIn(records, children);
+    while (it != records.end() && boost::starts_with(it->first, children))
+    {
+      size_t const dot = it->first.find('.', children.size());
+      std::string const segment = it->first.substr(children.size(),
+          dot == std::string::npos ? std::string::npos : dot - children.size());
+      if (segment.empty() || !it->second.isDefined())
+      {
+        if (segment.empty() && it->second.isDefined() && it->first != path)
+          complete = false;
+        ++it;
+        continue;
+      }
+      found.insert(segment);
+      if (dot == std::string::npos)
+        ++it;
+      else
+        it = lowerBoundIn(records, children + segment + char('.' + 1));
+    }
+    segments.assign(found.begin(), found.end());
+    return complete;
+  }
+
+  boost::scoped_ptr<FrozenTable> frozenStorage;
+  boost::atomic<FrozenTable const*> frozen;
+
+  boost::atomic<bool> lockTiming;
+  // What LockStats reports, in counters the lock guards update without a
+  // lock of their own.
+  struct LockCounters : private boost::noncopyable
+  {
+    struct Path : private boost::noncopyable
+    {
+      boost::atomic<boost::uint64_t> acquisitions;
+      boost::atomic<boost::uint64_t> contended;
+      boost::atomic<boost::uint64_t> waitTotal;
+      boost::atomic<boost::uint64_t> waitMax;
+      boost::atomic<boost::uint64_t> holdMax;
+      boost::atomic<boost::uint64_t> waiting;
+      boost::atomic<boost::uint64_t> waitHistogram[LockStats::HISTOGRAM_SIZE];
+
+      Path()
+      {
+        reset();
+      }
+
+      void reset()
+      {
+        acquisitions.store(0, boost::memory_order_relaxed);
+        contended.store(0, boost::memory_order_relaxed);
+        waitTotal.store(0, boost::memory_order_relaxed);
+        waitMax.store(0, boost::memory_order_relaxed);
+        holdMax.store(0, boost::memory_order_relaxed);
+        waiting.store(0, boost::memory_order_relaxed);
+        for (size_t i = 0; i < LockStats::HISTOGRAM_SIZE; ++i)
+          waitHistogram[i].store(0, boost::memory_order_relaxed);
+      }
+
+      void get(LockStats::Path & r) const
+      {
+        r.acquisitions = acquisitions.load(boost::memory_order_relaxed);
+        r.contended = contended.load(boost::memory_order_relaxed);
+        r.waitTotal = waitTotal.load(boost::memory_order_relaxed);
+        r.waitMax = waitMax.load(boost::memory_order_relaxed);
+        r.holdMax = holdMax.load(boost::memory_order_relaxed);
+        r.waiting = waiting.load(boost::memory_order_relaxed);
+        for (size_t i = 0; i < LockStats::HISTOGRAM_SIZE; ++i)
+          r.waitHistogram[i] = waitHistogram[i].load(boost::memory_order_relaxed);
+      }
+
+      void add(boost::uint64_t wait)
+      {
+        acquisitions.fetch_add(1, boost::memory_order_relaxed);
+        if (wait)
+          contended.fetch_add(1, boost::memory_order_relaxed);
+        waitTotal.fetch_add(wait, boost::memory_order_relaxed);
+        raise(waitMax, wait);
+        size_t bucket = 0;
+        while (wait && bucket + 1 < LockStats::HISTOGRAM_SIZE)
+        {
+          wait >>= 1;
+          ++bucket;
+        }
+        waitHistogram[bucket].fetch_add(1, boost::memory_order_relaxed);
+      }
+
+      static void raise(boost::atomic<boost::uint64_t> & max, boost::uint64_t value)
+      {
+        boost::uint64_t current = max.load(boost::memory_order_relaxed);
+        while (current < value && !max.compare_exchange_weak(current, value, boost::memory_order_relaxed))
+          ;
+      }
+    };
+
+    Path read;
+    Path write;
+  };
+
+  mutable LockCounters lockCounters;
+
+  static boost::posix_time::ptime lockClock()
+  {
+    return boost::posix_time::microsec_clock::universal_time();
+  }
+
+  // Holds the tree lock, counting into stats if lock statistics are on.
+  // Readers share it if the tree was created with Options::sharedReads.
+  class LockGuard : private boost::noncopyable
+  {
+  public:
+    LockGuard(PTree const& t, LockCounters::Path & stats)
+    : tree(&t), stats(stats), shared(false), timed(t.lockTiming.load(boost::memory_order_relaxed))
+    {
+      lock();
+    }
+
+    ~LockGuard()
+    {
+      if (!tree)
+        return;
+      if (timed)
+      {
+        boost::uint64_t const hold = (lockClock() - acquired).total_microseconds();
+        LockCounters::Path::raise(stats.holdMax, hold);
+      }
+      if (!tree->sharedReads)
+        tree->mutex.unlock();
+      else if (shared)
+        tree->sharedMutex.unlock_shared();
+      else
+        tree->sharedMutex.unlock();
+    }
+
+  protected:
+    // for ReadGuard, which shares the lock or skips it
+    LockGuard(PTree const& t, LockCounters::Path & stats, bool skip)
+    : tree(skip ? 0 : &t), stats(stats), shared(t.sharedReads),
+      timed(!skip && t.lockTiming.load(boost::memory_order_relaxed))
+    {
+      if (tree)
+        lock();
+    }
+
+  private:
+    bool tryLock() const
+    {
+      if (!tree->sharedReads)
+        return tree->mutex.try_lock();
+      return shared ? tree->sharedMutex.try_lock_shared() : tree->sharedMutex.try_lock();
+    }
+
+    void waitLock() const
+    {
+      if (!tree->sharedReads)
+        tree->mutex.lock();
+      else if (shared)
+        tree->sharedMutex.lock_shared();
+      else
+        tree->sharedMutex.lock();
+    }
+
+    void lock()
+    {
+      if (!timed)
+      {
+        waitLock();
+        return;
+      }
+      boost::uint64_t wait = 0;
+      if (!tryLock())
+      {
+        boost::posix_time::ptime const start = lockClock();
+        stats.waiting.fetch_add(1, boost::memory_order_relaxed);
+        waitLock();
+        stats.waiting.fetch_sub(1, boost::memory_order_relaxed);
+        acquired = lockClock();
+        wait = std::max<boost::int64_t>((acquired - start).total_microseconds(), 1);
+      }
+      else
+        acquired = lockClock();
+      stats.add(wait);
+    }
+
+    PTree const* tree;
+    LockCounters::Path & stats;
+    bool const shared;
+    bool const timed;
+    boost::posix_time::ptime acquired;
+  };
+
+  // Shares the tree lock with other readers, unless the tree is frozen.
+  class ReadGuard : public LockGuard
+  {
+  public:
+    ReadGuard(PTree const& t)
+    : LockGuard(t, t.lockCounters.read, t.frozen.load(boost::memory_order_acquire) != 0)
+    { }
+  };
+
+  static size_t heapBytes(std::string const& s)
+  {
+    char const* self = reinterpret_cast<char const*>(&s);
+    bool const isInline = s.data() >= self && s.data() < self + sizeof(s);
+    return isInline ? 0 : s.capacity() + 1;
+  }
+
+  static void addUsage(MemoryUsage & u, std::string const& key, Record const& r)
+  {
+    ++u.records;
+    u.keyBytes += heapBytes(key);
+    u.valueBytes += heapBytes(r.value);
+    if (r.defined)
+      ++u.definedRecords;
+    if (r.pathData)
+    {
+      ++u.pathDataRecords;
+      u.totalBytes += sizeof(PathPropData) + heapBytes(r.pathData->originalPath)
+                    + heapBytes(r.pathData->originalFilePath);
+    }
+    if (r.elements)
+    {
+      ++u.arrayRecords;
+      u.totalBytes += sizeof(Record::elements_t)
+                    + r.elements->capacity() * sizeof(std::string);
+      for (size_t i = 0; i < r.elements->size(); ++i)
+        u.valueBytes += heapBytes((*r.elements)[i]);
+    }
+  }
+
+  void checkNotFrozen(std::string const& path) const
+  {
+    if (frozen.load(boost::memory_order_relaxed))
+      throw PropsError(path, "Cannot modify a frozen PTree: ");
+  }
+
+  Record & getRecord(std::string const& path)
+  {
+    checkNotFrozen(path);
+    return propMap[path];
+  }
+
+  // Writers notify from a copy taken under the lock; the shared flag stops
+  // calls to listeners removed since the copy was made.
+  struct Subscription
+  {
+    std::string prefix;
+    PListener listener;
+    boost::shared_ptr<boost::atomic<bool> > alive;
+  };
+
+  typedef std::map<size_t, Subscription> listeners_t;
+  listeners_t listeners;
+  size_t lastListenerId;
+
+  static void applyEntry(Record & r, Batch::Entry const& e)
+  {
+    switch (e.op)
+    {
+    case Batch::ASSIGN:
+      r = e.record;
+      break;
+    case Batch::UPDATE:
+      r.assignValue(e.record);
+      break;
+    case Batch::UNDEFINE:
+    case Batch::ERASE:
+      r.undefine();
+      break;
+    }
+  }
+
+  // subtrees erased so far, with the version of the erasing write, for
+  // ConstRef::getChangesSince; their records are gone
+  std::vector<std::pair<boost::uint64_t, std::string> > erasures;
+
+  // Removes the records at path and below it, masking the records of the
+  // attached sources there with undefined ones; the caller holds the lock.
+  void eraseRange(std::string const& path, boost::uint64_t stamp,
+                  std::vector<Source::entry_t> * changes)
+  {
+    checkNotFrozen(path);
+    std::string const children = path.empty() ? path : path + ".";
+
+    propmap_t::iterator it = path.empty() ? propMap.end() : propMap.find(path);
+    if (it != propMap.end())
+    {
+      if (changes && it->second.isDefined())
+        changes->push_back(Source::entry_t(it->first, Record()));
+      propMap.erase(it);
+    }
+    it = propMap.lower_bound(children);
+    while (it != propMap.end() && boost::starts_with(it->first, children))
+    {
+      if (changes && it->second.isDefined())
+        changes->push_back(Source::entry_t(it->first, Record()));
+      propMap.erase(it++);
+    }
+
+    std::vector<Source::entry_t> shadowed;
+    listSources(path, shadowed);
+    for (size_t i = 0; i < shadowed.size(); ++i)
+    {
+      if (!shadowed[i].second.isDefined())
+        continue;
+      Record & r = propMap[shadowed[i].first];
+      r.version = stamp;
+      if (changes)
+        changes->push_back(Source::entry_t(shadowed[i].first, r));
+    }
+
+    erasures.push_back(std::make_pair(stamp, path));
+  }
+
+  void notify(listeners_t const& targets, std::vector<Source::entry_t> const& changes)
+  {
+    for (listeners_t::const_iterator it = targets.begin(); it != targets.end(); ++it)
+    {
+      std::string const& p = it->second.prefix;
+      std::vector<Source::entry_t> selected;
+      for (size_t i = 0; i < changes.size(); ++i)
+        if (p.empty() || changes[i].first == p || boost::starts_with(changes[i].first, p + "."))
+          selected.push_back(changes[i]);
+      if (!selected.empty() && it->second.alive->load(boost::memory_order_acquire))
+        it->second.listener->onChange(p, selected);
+    }
+  }
+
+  // The only way records are modified: all entries under one lock, then one
+  // notification per interested listener once the lock is released.
+  void write(std::string const& prefix, Batch::Entry const* entries, size_t count)
+  {
+    std::vector<Source::entry_t> changes;
+    listeners_t targets;
+    {
+      LockGuard g(*this, lockCounters.write);
+      checkNotFrozen(prefix);
+      boost::uint64_t const stamp = ++version;
+      for (size_t i = 0; i < count; ++i)
+      {
+        std::string const path = joinPaths(prefix, entries[i].path);
+        if (entries[i].op == Batch::ERASE)
+        {
+          ++cacheEpoch;
+          eraseRange(path, stamp, listeners.empty() ? 0 : &changes);
+          continue;
+        }
+        ++pathStamps[stripeOf(path)];
+        Record & r = getRecord(path);
+        if (listeners.empty())
+        {
+          applyEntry(r, entries[i]);
+          r.version = stamp;
+          continue;
+        }
+        Record const before = r;
+        applyEntry(r, entries[i]);
+        r.version = stamp;
+        if (!r.sameValue(before))
+          changes.push_back(Source::entry_t(path, r));
+      }
+      if (!changes.empty())
+        targets = listeners;
+    }
+    notify(targets, changes);
+  }
+
+  // Replaces the subtree at to with the defined records at from, then erases
+  // from if move is set, all in one write.
+  void transfer(std::string const& from, std::string const& to, bool move)
+  {
+    if (move && (from.empty() || to == from || boost::starts_with(to, from + ".")))
+      throw PropsError(from, "Cannot move a subtree into itself: ");
+
+    std::vector<Source::entry_t> changes;
+    listeners_t targets;
+    {
+      LockGuard g(*this, lockCounters.write);
+      checkNotFrozen(to);
+      std::vector<Source::entry_t> records;
+      RangeCollector c(records, from);
+      visitSubtree(from, c);
+
+      boost::uint64_t const stamp = ++version;
+      ++cacheEpoch;
+      std::vector<Source::entry_t> * const log = listeners.empty() ? 0 : &changes;
+      eraseRange(to, stamp, log);
+      for (size_t i = 0; i < records.size(); ++i)
+      {
+        std::string const path = joinPaths(to, records[i].first);
+        Record & r = propMap[path];
+        r = records[i].second;
+        r.version = stamp;
+        if (log)
+          log->push_back(Source::entry_t(path, r));
+      }
+      if (move)
+        eraseRange(from, stamp, log);
+      if (!changes.empty())
+        targets = listeners;
+    }
+    notify(targets, changes);
+  }
+
+  // defined records with keys relative to prefix
+  struct RangeCollector
+  {
+    std::vector<Source::entry_t> & result;
+    std::string const& prefix;
+
+    RangeCollector(std::vector<Source::entry_t> & result, std::string const& prefix)
+    : result(result), prefix(prefix)
+    { }
+
+    void operator () (std::string const& key, Record const& r)
+    {
+      if (!r.isDefined())
+        return;
+      result.push_back(Source::entry_t(key.size() == prefix.size() ? std::string()
+                                       : key.substr(prefix.empty() ? 0 : prefix.size() + 1), r));
+    }
+  };
+
+  struct Attached
+  {
+    std::string name;
+    PSource source;
+
+    Attached(std::string const& name, PSource const& source)
+    : name(name), source(source)
+    { }
+  };
+
+  std::vector<Attached> sources; // topmost first
+
+  // incremented by every modification; layers above use it to validate
+  // their resolution cache
+  boost::atomic<boost::uint64_t> version;
+
+  // Never reused, unlike the address of the tree: per-thread state found
+  // through a thread_specific_ptr member outlives the tree on the other
+  // threads, and a tree built at the same address must not pick it up.
+  boost::uint64_t const id;
+
+  // What the read caches check their entries against, so that a write
+  // leaves the cached reads of other paths valid.  Writing a record bumps
+  // the stamp of its path's stripe; erasing a subtree, moving one, clearing
+  // the tree or changing its sources bumps cacheEpoch, which voids them all.
+  enum { PATH_STRIPES = 64 };
+  boost::atomic<boost::uint64_t> cacheEpoch;
+  boost::atomic<boost::uint64_t> pathStamps[PATH_STRIPES];
+
+  void clearPathStamps()
+  {
+    for (size_t i = 0; i < PATH_STRIPES; ++i)
+      pathStamps[i].store(0, boost::memory_order_relaxed);
+  }
+
+  // A read of path depends on the record there, on its array for an index
+  // key, and on its override candidates, which all end in the same last
+  // segment that is not a number; the stripe is a hash of that segment.
+  // False for a path of numbers alone, whose candidates share no segment.
+  static bool pathStripe(char const* p, size_t n, size_t & stripe)
+  {
+    size_t end = n;
+    while (end)
+    {
+      size_t begin = end;
+      while (begin && p[begin - 1] != '.')
+        --begin;
+      bool numeric = begin < end;
+      for (size_t i = begin; numeric && i < end; ++i)
+        numeric = p[i] >= '0' && p[i] <= '9';
+      if (!numeric)
+      {
+        stripe = static_cast<size_t>(hashPath(p + begin, end - begin) % PATH_STRIPES);
+        return true;
+      }
+      if (!begin)
+        break;
+      end = begin - 1;
+    }
+    return false;
+  }
+
+  // the stripe of a full path; paths of numbers alone share the first
+  static size_t stripeOf(std::string const& path)
+  {
+    size_t stripe = 0;
+    return pathStripe(path.data(), path.size(), stripe) ? stripe : 0;
+  }
+
+  static boost::uint64_t nextId()
+  {
+    static boost::atomic<boost::uint64_t> last(0);
+    return ++last;
+  }
+
+  // for recent paths looked up in the sources: the index of the source that
+  // holds it, or npos, in a fixed table direct mapped by a hash of the path;
+  // a slot is valid while the sum of source versions is the one it was
+  // filled at, and the table is emptied when the sources change
+  struct ResolvedSlot
+  {
+    bool filled;
+    boost::uint64_t hash;
+    boost::uint64_t stamp; // sourcesStamp()
+    std::string path;
+    size_t index;
+
+    ResolvedSlot()
+    : filled(false), hash(0), stamp(0), index(0)
+    { }
+  };
+
+  enum { RESOLVED_SLOTS = 256 };
+  mutable std::vector<ResolvedSlot> resolved; // sized on first use
+
+  // guards the lookup caches, resolved and overrides, which readers sharing
+  // the tree lock fill; never held while calling into a source
+  mutable boost::mutex cacheMutex;
+
+  class CacheGuard : private boost::noncopyable
+  {
+  public:
+    CacheGuard(PTree const& t)
+    : m(t.sharedReads ? &t.cacheMutex : 0)
+    {
+      if (m)
+        m->lock();
+    }
+
+    ~CacheGuard()
+    {
+      if (m)
+        m->unlock();
+    }
+
+  private:
+    boost::mutex *m;
+  };
+
+  boost::uint64_t sourcesStamp() const
+  {
+    boost::uint64_t stamp = 0;
+    for (size_t i = 0; i < sources.size(); ++i)
+      stamp += sources[i].source->getVersion();
+    return stamp;
+  }
+
+  Record const* findInSources(std::string const& path, Record & tmp, size_t *index = 0) const
+  {
+    if (sources.empty())
+      return 0;
+    if (sources.size() == 1)
+    {
+      if (index)
+        *index = 0;
+      return sources[0].source->find(path, tmp) ? &tmp : 0;
+    }
+
+    boost::uint64_t const stamp = sourcesStamp();
+    boost::uint64_t const hash = hashPath(path.data(), path.size());
+    size_t found = 0;
+    bool cached = false;
+    {
+      CacheGuard g(*this);
+      if (!resolved.empty())
+      {
+        ResolvedSlot const& e = resolved[hash % RESOLVED_SLOTS];
+        if (e.filled && e.hash == hash && e.stamp == stamp && e.path == path)
+        {
+          found = e.index;
+          cached = true;
+        }
+      }
+    }
+
+    if (!cached)
+    {
+      while (found < sources.size() && !sources[found].source->find(path, tmp))
+        ++found;
+      if (found == sources.size())
+        found = std::string::npos;
+      CacheGuard g(*this);
+      if (resolved.empty())
+        resolved.resize(RESOLVED_SLOTS);
+      ResolvedSlot & e = resolved[hash % RESOLVED_SLOTS];
+      e.filled = true;
+      e.hash = hash;
+      e.stamp = stamp;
+      e.path = path;
+      e.index = found;
+    }
+    if (index)
+      *index = found;
+    if (found == std::string::npos)
+      return 0;
+    return cached ? (sources[found].source->find(path, tmp) ? &tmp : 0) : &tmp;
+  }
+
+  Record const* findExact(std::string const& path, Record & tmp) const
+  {
+    FrozenTable const* table = frozen.load(boost::memory_order_relaxed);
+    if (table)
+      return table->find(path);
+
+    propmap_t::const_iterator const it = propMap.find(path);
+    if (it != propMap.end())
+      return &it->second;
+    return findInSources(path, tmp);
+  }
+
+  // Lookup without inserting: the record at path itself or, for an index
+  // key like "name.3" of an array record, its element copied into tmp.
+  Record const* findRecord(std::string const& path, Record & tmp) const
+  {
+    Record const* r = findExact(path, tmp);
+    if (r)
+      return r;
+
+    size_t const pos = path.rfind('.');
+    if (pos == std::string::npos || pos + 1 == path.size())
+      return 0;
+    size_t index = 0;
+    for (size_t i = pos + 1; i < path.size(); ++i)
+    {
+      if (path[i] < '0' || path[i] > '9')
+        return 0;
+      index = index * 10 + (path[i] - '0');
+    }
+    Record const* arr = findExact(path.substr(0, pos), tmp);
+    if (!arr || !arr->isDefined() || !arr->isArray())
+      return 0;
+    Record::elements_t const& elems = arr->getElements();
+    if (index >= elems.size())
+      return 0;
+    std::string const element = elems[index];
+    tmp.setValue(element);
+    return &tmp;
+  }
+
+  // For id "a.b", the records at prefix.a.b.path and then prefix.b.path
+  // override prefix.path.  The winning path of recent (id, path) lookups is
+  // kept in a fixed table, direct mapped by a hash of the key, until a write
+  // to the stripe of path, a structural change (see cacheEpoch) or a change
+  // of the sources; frozen trees probe every time, since their readers take
+  // no lock to update the table under, and so do paths without a stripe.
+  struct OverrideSlot
+  {
+    bool filled;
+    boost::uint64_t hash;
+    boost::uint64_t epoch;
+    boost::uint64_t stamp;   // of the stripe
+    boost::uint64_t sources; // sourcesStamp()
+    std::string id;
+    std::string prefix;
+    std::string path;
+    std::string winner;
+
+    OverrideSlot()
+    : filled(false), hash(0), epoch(0), stamp(0), sources(0)
+    { }
+  };
+
+  enum { OVERRIDE_SLOTS = 256 };
+  mutable std::vector<OverrideSlot> overrides; // sized on first use
+
+  Record const* findOverride(std::string const& prefix, std::string const& id,
+                             std::string const& path, Record & tmp,
+                             std::string *resolvedPath = 0) const
+  {
+    if (id.empty())
+    {
+      std::string const fullPath = joinPaths(prefix, path);
+      if (resolvedPath)
+        *resolvedPath = fullPath;
+      return findRecord(fullPath, tmp);
+    }
+
+    size_t stripe = 0;
+    bool const cached = !frozen.load(boost::memory_order_relaxed)
+                        && pathStripe(path.data(), path.size(), stripe);
+    boost::uint64_t hash = 0;
+    boost::uint64_t epoch = 0;
+    boost::uint64_t stamp = 0;
+    boost::uint64_t sourced = 0;
+    if (cached)
+    {
+      hash = hashPath(id.data(), id.size());
+      hash = hashPath(prefix.data(), prefix.size(), hash);
+      hash = hashPath(path.data(), path.size(), hash);
+      epoch = cacheEpoch.load(boost::memory_order_relaxed);
+      stamp = pathStamps[stripe].load(boost::memory_order_relaxed);
+      sourced = sourcesStamp();
+      std::string winner;
+      bool hit = false;
+      {
+        CacheGuard g(*this);
+        if (!overrides.empty())
+        {
+          OverrideSlot const& e = overrides[hash % OVERRIDE_SLOTS];
+          if (e.filled && e.hash == hash && e.epoch == epoch && e.stamp == stamp
+              && e.sources == sourced && e.path == path && e.prefix == prefix && e.id == id)
+          {
+            winner = e.winner;
+            hit = true;
+          }
+        }
+      }
+      if (hit)
+      {
+        if (resolvedPath)
+          *resolvedPath = winner;
+        return findRecord(winner, tmp);
+      }
+    }
+
+    std::string scope = id;
+    while (true)
+    {
+      std::string const candidate = joinPaths(prefix, joinPaths(scope, path));
+      tmp = Record();
+      Record const* r = findRecord(candidate, tmp);
+      if (scope.empty() || (r && r->isDefined()))
+      {
+        if (cached)
+        {
+          CacheGuard g(*this);
+          if (overrides.empty())
+            overrides.resize(OVERRIDE_SLOTS);
+          OverrideSlot & e = overrides[hash % OVERRIDE_SLOTS];
+          e.filled = true;
+          e.hash = hash;
+          e.epoch = epoch;
+          e.stamp = stamp;
+          e.sources = sourced;
+          e.id = id;
+          e.prefix = prefix;
+          e.path = path;
+          e.winner = candidate;
+        }
+        if (resolvedPath)
+          *resolvedPath = candidate;
+        return r;
+      }
+      size_t const dot = scope.find('.');
+      scope = dot == std::string::npos ? std::string() : scope.substr(dot + 1);
+    }
+  }
+
+  // Calls visit(i, record or 0) for each of the sorted paths relative to
+  // prefix.  Nearby keys are reached by stepping the previous map position
+  // instead of searching the whole map again.
+  template <typename TVisitor>
+  void visitPaths(std::string const& prefix, std::vector<std::string> const& sortedPaths,
+                  TVisitor & visit) const
+  {
+    bool const plainMap = !frozen.load(boost::memory_order_relaxed) && sources.empty();
+    propmap_t::const_iterator it = propMap.begin();
+    for (size_t i = 0; i < sortedPaths.size(); ++i)
+    {
+      std::string const path = joinPaths(prefix, sortedPaths[i]);
+      Record tmp;
+      if (plainMap)
+      {
+        int steps = 0;
+        while (it != propMap.end() && it->first < path && ++steps < 8)
+          ++it;
+        if (it != propMap.end() && it->first < path)
+          it = propMap.lower_bound(path);
+        if (it != propMap.end() && it->first == path)
+        {
+          visit(i, &it->second);
+          continue;
+        }
+      }
+      visit(i, findRecord(path, tmp));
+    }
+  }
+
+  // records of all sources at prefix and below, upper sources shadowing lower
+  void listSources(std::string const& prefix, std::vector<Source::entry_t> & result) const
+  {
+    for (size_t l = sources.size(); l-- > 0; )
+    {
+      std::vector<Source::entry_t> upper;
+      sources[l].source->listRecords(prefix, upper);
+      if (result.empty())
+      {
+        result.swap(upper);
+        continue;
+      }
+
+      std::vector<Source::entry_t> merged;
+      merged.reserve(result.size() + upper.size());
+      std::vector<Source::entry_t>::const_iterator a = upper.begin(), b = result.begin();
+      while (a != upper.end() || b != result.end())
+      {
+        if (b == result.end() || (a != upper.end() && a->first <= b->first))
+        {
+          if (b != result.end() && a->first == b->first)
+            ++b;
+          merged.push_back(*a++);
+        }
+        else
+          merged.push_back(*b++);
+      }
+      result.swap(merged);
+    }
+  }
+
+  // as visitSubtree, for the tree's own records only
+  template <typename TVisitor>
+  void visitOwn(std::string const& prefix, TVisitor & visit) const
+  {
+    std::string const children = prefix.empty() ? prefix : prefix + ".";
+
+    FrozenTable const* table = frozen.load(boost::memory_order_relaxed);
+    if (table)
+    {
+      FrozenTable::entries_t::const_iterator it = table->lowerBound(prefix);
+      if (!prefix.empty() && it != table->entries.end() && it->first == prefix)
+        visit(it->first, it->second);
+      for (it = table->lowerBound(children);
+           it != table->entries.end() && boost::starts_with(it->first, children);
+           ++it)
+        visit(it->first, it->second);
+      return;
+    }
+
+    propmap_t::const_iterator it = prefix.empty() ? propMap.end() : propMap.find(prefix);
+    if (it != propMap.end())
+      visit(it->first, it->second);
+    for (it = propMap.lower_bound(children);
+         it != propMap.end() && boost::starts_with(it->first, children);
+         ++it)
+      visit(it->first, it->second);
+  }
+
+  // Calls visit(key, record) for the record at prefix and every record below
+  // it in key order; own records shadow those of the attached sources.
+  template <typename TVisitor>
+  void visitSubtree(std::string const& prefix, TVisitor & visit) const
+  {
+    if (frozen.load(boost::memory_order_relaxed))
+    {
+      visitOwn(prefix, visit);
+      return;
+    }
+
+    std::string const children = prefix.empty() ? prefix : prefix + ".";
+
+    std::vector<Source::entry_t> fromSource;
+    listSources(prefix, fromSource);
+    std::vector<Source::entry_t>::const_iterator s = fromSource.begin();
+
+    // the record at prefix itself, then the contiguous "prefix.*" range;
+    // siblings like "a-b" sort in between and are skipped this way
+    propmap_t::const_iterator exact = prefix.empty() ? propMap.end() : propMap.find(prefix);
+    propmap_t::const_iterator it = propMap.lower_bound(children);
+    while (true)
+    {
+      propmap_t::const_iterator own = exact;
+      if (own == propMap.end() && it != propMap.end() && boost::starts_with(it->first, children))
+        own = it;
+      if (own == propMap.end() && s == fromSource.end())
+        break;
+
+      if (own != propMap.end() && (s == fromSource.end() || own->first <= s->first))
+      {
+        if (s != fromSource.end() && own->first == s->first)
+          ++s;
+        visit(own->first, own->second);
+        if (own == exact)
+          exact = propMap.end();
+        else
+          ++it;
+      }
+      else
+      {
+        visit(s->first, s->second);
+        ++s;
+      }
+    }
+  }
+
+  // read counters of one thread; its mutex is only contended while merging
+  struct ReadLog
+  {
+    boost::uint64_t tree; // PTree::id
+    boost::mutex mutex;
+    access_stats_t reads;
+
+    explicit ReadLog(boost::uint64_t tree)
+    : tree(tree)
+    { }
+  };
+
+  typedef boost::shared_ptr<ReadLog> PReadLog;
 
-  ConstRef root(const std::string &id) const;
-  Ref      root(const std::string &id);
+  boost::atomic<bool> tracking;
+  mutable boost::thread_specific_ptr<PReadLog> threadLog;
+  mutable std::vector<PReadLog> readLogs;
+  mutable boost::mutex logsMutex;
 
-  static std::string joinPaths(const std::string &p1, const std::string &p2)
+  void countRead(std::string const& path) const
   {
-    if (p1.empty())
-      return p2;
-    if (p2.empty())
-      return p1;
-    return p1 + "." + p2;
+    PReadLog *log = threadLog.get();
+    if (!log || (*log)->tree != id)
+    {
+      log = new PReadLog(new ReadLog(id));
+      threadLog.reset(log);
+      boost::lock_guard<boost::mutex> g(logsMutex);
+      readLogs.push_back(*log);
+    }
+    boost::posix_time::ptime const now = boost::posix_time::microsec_clock::universal_time();
+    boost::lock_guard<boost::mutex> g((*log)->mutex);
+    AccessStats & s = (*log)->reads[path];
+    ++s.reads;
+    s.lastRead = now;
   }
 
-  static bool isSimplePath(const std::string &p)
+  // recent typed gets of one thread, direct mapped by a hash of the ref and
+  // path; entries are valid while the tree's cacheEpoch and the stamp of
+  // their path's stripe are those they were filled at
+  struct ReadCache
   {
-    return !p.empty() && p.find('.') == std::string::npos;
-  }
+    enum { SIZE = 256 };
 
-  static std::string splitFirst(const std::string &p)
-  {
-    size_t const pos = p.find('.');
-    if (pos == std::string::npos)
-      return p;
-    else
-      return p.substr(0, pos);
-  }
+    boost::uint64_t tree; // PTree::id
 
-  void clear()
-  {
-    propMap.clear();
-  }
+    explicit ReadCache(boost::uint64_t tree)
+    : tree(tree)
+    { }
 
-private:
+    struct Entry
+    {
+      bool filled;
+      boost::uint64_t epoch;
+      size_t stripe;
+      boost::uint64_t stamp;
+      boost::uint64_t hash;
+      std::type_info const* type;
+      bool idOverrides;
+      std::string selfPath;
+      std::string selfId;
+      std::string path;
+      bool defined;
+      boost::shared_ptr<Record::Typed const> value; // none if not convertible
+
+      Entry()
+      : filled(false), epoch(0), stripe(0), stamp(0), hash(0), type(0), idOverrides(false), defined(false)
+      { }
+    };
+
+    Entry entries[SIZE];
+  };
 
-  typedef std::map<std::string, Record> propmap_t;
-  propmap_t propMap;
+  typedef boost::shared_ptr<ReadCache> PReadCache;
 
-  Record & getRecord(std::string const& path)
+  boost::atomic<bool> readCaching;
+  mutable boost::thread_specific_ptr<PReadCache> threadCache;
+  mutable std::vector<PReadCache> readCaches; // owned here, released with the tree
+  mutable boost::mutex readCachesMutex;
+
+  ReadCache & threadReadCache() const
   {
-    return propMap[path];
+    // versions restart with every tree, so a cache left by a destroyed tree
+    // at the same address would hit on matching epochs
+    PReadCache *cache = threadCache.get();
+    if (!cache || (*cache)->tree != id)
+    {
+      cache = new PReadCache(new ReadCache(id));
+      threadCache.reset(cache);
+      boost::lock_guard<boost::mutex> g(readCachesMutex);
+      readCaches.push_back(*cache);
+    }
+    return **cache;
   }
 
+  struct UnreadCollector
+  {
+    std::vector<std::string> & result;
+    std::set<std::string> const& read;
+
+    UnreadCollector(std::vector<std::string> & result, std::set<std::string> const& read)
+    : result(result), read(read)
+    { }
+
+    void operator () (std::string const& key, Record const& r)
+    {
+      if (r.isDefined() && !read.count(key))
+        result.push_back(key);
+    }
+  };
+
   friend class Ref;
   friend class ConstRef;
 
-  boost::mutex mutex;
+  mutable boost::mutex mutex;
+  mutable boost::shared_mutex sharedMutex; // instead of mutex with sharedReads
+  bool const sharedReads;
 };
 
 class PTree::ConstRef
 {
 public:
   ConstRef()
-  : owner(0)
+  : owner(0),
+    idOverrides(false)
   { }
 
   bool hasOwner() const { return owner != 0; }
@@ -192,24 +2074,31 @@ public:
   PTree::Record getRecord(const std::string &path) const
   {
     assert(owner);
-    return owner->getRecord(PTree::joinPaths(selfPath, path));
+    PTree::ReadGuard g(*owner);
+    PTree::Record tmp;
+    PTree::Record const* r = find(path, tmp);
+    return r ? *r : PTree::Record();
   }
 
   template <typename TData>
   TData get(const std::string &path, const TData &defaultValue) const
   {
-    using boost::lexical_cast;
-    assert(owner);
-    boost::unique_lock<boost::mutex> g(owner->mutex);
-    return getRecord(path).get_as<TData>().get_value_or(defaultValue);
+    return getOptional<TData>(path).get_value_or(defaultValue);
   }
 
   template <typename TData>
   boost::optional<TData> getOptional(const std::string &path, bool *getDefined = 0) const
   {
     assert(owner);
-    boost::unique_lock<boost::mutex> g(owner->mutex);
-    return getRecord(path).get_as<TData>(getDefined);
+    if (owner->readCaching.load(boost::memory_order_relaxed)
+        && !owner->tracking.load(boost::memory_order_relaxed))
+      return getCached<TData>(path, getDefined);
+    PTree::ReadGuard g(*owner);
+    PTree::Record tmp;
+    PTree::Record const* r = find(path, tmp);
+    if (!r)
+      return tmp.get_as<TData>(getDefined);
+    return r->get_as<TData>(getDefined);
   }
 
   template <typename TData>
@@ -222,6 +2111,79 @@ public:
     return *v;
   }
 
+  // Typed lookups by compile-time key; on a frozen tree they hash no more
+  // than the ref's own path and allocate nothing.
+  template <typename TData>
+  boost::optional<TData> getOptional(Key<TData> const& key) const
+  {
+    assert(owner);
+    FrozenTable const* table = owner->frozen.load(boost::memory_order_acquire);
+    if (table && !idOverrides && !owner->tracking.load(boost::memory_order_relaxed))
+    {
+      boost::uint64_t hash = key.getHash();
+      if (!selfPath.empty())
+      {
+        hash = PTree::hashPath(selfPath.data(), selfPath.size());
+        hash = PTree::hashPath(".", 1, hash);
+        hash = PTree::hashPath(key.getPath(), key.getSize(), hash);
+      }
+      PTree::Record const* r = table->find(selfPath, key.getPath(), key.getSize(), hash);
+      if (r)
+        return r->get_as<TData>();
+    }
+    return getOptional<TData>(key.toString());
+  }
+
+  template <typename TData>
+  TData get(Key<TData> const& key) const
+  {
+    boost::optional<TData> const v = getOptional(key);
+    return v ? *v : get<TData>(key.toString()); // throws the usual PropsError
+  }
+
+  // the key alone gives TData: the value converts, as in get(kName, "none")
+  template <typename TData>
+  TData get(Key<TData> const& key, typename Key<TData>::value_type const& defaultValue) const
+  {
+    return getOptional(key).get_value_or(defaultValue);
+  }
+
+  template <typename TData>
+  boost::optional<std::vector<TData> > getArrayOptional(const std::string &path, bool *getDefined = 0) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    PTree::Record tmp;
+    PTree::Record const* r = find(path, tmp);
+    if (!r)
+      return tmp.get_array_as<TData>(getDefined);
+    return r->get_array_as<TData>(getDefined);
+  }
+
+  // the array without a copy when it was written as std::vector<TData>,
+  // see Record::get_array_ptr
+  template <typename TData>
+  boost::shared_ptr<std::vector<TData> const> getArrayPtr(const std::string &path, bool *getDefined = 0) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    PTree::Record tmp;
+    PTree::Record const* r = find(path, tmp);
+    if (!r)
+      return tmp.get_array_ptr<TData>(getDefined);
+    return r->get_array_ptr<TData>(getDefined);
+  }
+
+  template <typename TData>
+  std::vector<TData> getArray(const std::string &path) const
+  {
+    bool isDefined = false;
+    boost::optional<std::vector<TData> > const v = getArrayOptional<TData>(path, &isDefined);
+    if (!v)
+      throw PropsError(getSelfPath() + "." + path, isDefined ? "Bad format " : "Undefined property: ");
+    return *v;
+  }
+
   template <typename TData>
   TData getValue(const TData &defaultValue) const
   {
@@ -237,33 +2199,113 @@ public:
   void listKeysRecursive(std::vector<std::string> & result, bool withUndefined = false) const
   {
     assert(owner);
-    boost::unique_lock<boost::mutex> g(owner->mutex);
+    PTree::ReadGuard g(*owner);
+    KeyCollector c(result, selfPath, withUndefined);
+    owner->visitSubtree(selfPath, c);
+  }
 
-    propmap_t const& pm = owner->propMap;
-    propmap_t::const_iterator it = pm.lower_bound(selfPath);
-    if (selfPath.empty())
+  // Name of the layer the value at path comes from: empty for the tree's own
+  // records, none if the path is undefined.
+  boost::optional<std::string> getOrigin(const std::string &path) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    std::string const fullPath = PTree::joinPaths(selfPath, path);
+    PTree::Record tmp;
+    PTree::Record const* r = 0;
+    if (owner->frozen.load(boost::memory_order_relaxed))
+      r = owner->findExact(fullPath, tmp);
+    else
     {
-      while (it != pm.end())
-      {
-        if (withUndefined || it->second.isDefined())
-          result.push_back(it->first);
-        ++it;
-      }
+      propmap_t::const_iterator const it = owner->propMap.find(fullPath);
+      if (it != owner->propMap.end())
+        r = &it->second;
     }
-    else
+    if (r)
+      return r->isDefined() ? std::string() : boost::optional<std::string>();
+
+    size_t index = std::string::npos;
+    r = owner->findInSources(fullPath, tmp, &index);
+    if (!r || !r->isDefined())
+      return boost::optional<std::string>();
+    return owner->sources[index].name;
+  }
+
+  // Calls visit(i, record) for every path in sortedPaths (relative, in
+  // ascending order) under a single lock; record is 0 for missing paths.
+  // Checks that are not reads by the application, like Schema::apply, pass
+  // countReads false to stay out of the access statistics.
+  template <typename TVisitor>
+  void visitRecords(std::vector<std::string> const& sortedPaths, TVisitor & visit,
+                    bool countReads = true) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    if (!idOverrides || selfId.empty())
     {
-      while (it != pm.end() && boost::starts_with(it->first, selfPath))
-      {
-        if (withUndefined || it->second.isDefined())
-        {
-          if (selfPath == it->first)
-            result.push_back("");
-          else
-            result.push_back(it->first.substr(selfPath.size() + 1)); // to remove the path separator
-        }
-        ++it;
-      }
+      owner->visitPaths(selfPath, sortedPaths, visit);
+      if (countReads && owner->tracking.load(boost::memory_order_relaxed))
+        for (size_t i = 0; i < sortedPaths.size(); ++i)
+          owner->countRead(PTree::joinPaths(selfPath, sortedPaths[i]));
+      return;
+    }
+    for (size_t i = 0; i < sortedPaths.size(); ++i)
+    {
+      PTree::Record tmp;
+      visit(i, find(sortedPaths[i], tmp, countReads));
+    }
+  }
+
+  // Calls visit(view) with a PTree::NodeView of this subtree, all in one
+  // lock.  Nothing is copied unless sources are attached, in which case the
+  // subtree is merged into a copy first.
+  template <typename TVisitor>
+  void visitNodes(TVisitor & visit) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    PTree::FrozenTable const* table = owner->frozen.load(boost::memory_order_relaxed);
+    PTree::FrozenTable merged;
+    if (!table && !owner->sources.empty())
+    {
+      PTree::FrozenTable::Builder b(merged);
+      owner->visitSubtree(selfPath, b);
+      table = &merged;
+    }
+    PTree::NodeView const view(*owner, selfPath, table ? &table->entries : 0);
+    visit(view);
+  }
+
+  // same as listKeysRecursive, but copies the records along, all in one lock
+  void listRecordsRecursive(std::vector<PTree::Source::entry_t> & result, bool withUndefined = false) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    RecordCollector c(result, selfPath, withUndefined);
+    owner->visitSubtree(selfPath, c);
+  }
+
+  // Appends the tree's own records at and below this ref that were written
+  // after version since (see PTree::getVersion), undefined ones as undefines,
+  // preceded by the subtree erasures since then, so that the patch replays
+  // them elsewhere.  Scans the subtree; records of
+  // attached sources are not versioned by this tree and not included.
+  void getChangesSince(boost::uint64_t since, PTree::Batch & patch) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    for (size_t i = 0; i < owner->erasures.size(); ++i)
+    {
+      if (owner->erasures[i].first <= since)
+        continue;
+      std::string const& erased = owner->erasures[i].second;
+      if (erased.empty() || erased == selfPath || boost::starts_with(selfPath, erased + "."))
+        patch.erase("");
+      else if (selfPath.empty() || boost::starts_with(erased, selfPath + "."))
+        patch.erase(relativeKey(erased, selfPath));
     }
+    ChangeCollector c(patch, selfPath, since);
+    owner->visitOwn(selfPath, c);
   }
 
   void listKeys(std::vector<std::string> & result, bool withUndefined = false) const
@@ -302,6 +2344,15 @@ public:
     return getSubtreeImpl<ConstRef>(path);
   }
 
+  // A copy whose reads (and those of its subtrees) prefer the overrides
+  // along its ID: "cam7.threshold" over "threshold" for ID "app.cam7".
+  ConstRef withIdOverrides(bool enable = true) const
+  {
+    ConstRef r = *this;
+    r.idOverrides = enable;
+    return r;
+  }
+
   std::string const& getPath() const { return selfPath; }
   std::string const& getId() const { return selfId; }
 
@@ -312,7 +2363,8 @@ protected:
            const std::string &selfId)
   : owner(&owner),
     selfPath(selfPath),
-    selfId(selfId)
+    selfId(selfId),
+    idOverrides(false)
   {
     assert(this->owner);
   }
@@ -327,13 +2379,167 @@ protected:
 
   std::string selfPath;
   std::string selfId;
+  bool idOverrides;
+
+  // getOptional through the thread's read cache of the tree
+  template <typename TData>
+  boost::optional<TData> getCached(const std::string &path, bool *getDefined) const
+  {
+    boost::uint64_t hash = PTree::hashPath(selfPath.data(), selfPath.size());
+    hash = PTree::hashPath(selfId.data(), selfId.size(), hash);
+    hash = PTree::hashPath(path.data(), path.size(), hash);
+    PTree::ReadCache::Entry & e = owner->threadReadCache().entries[hash % PTree::ReadCache::SIZE];
+    if (e.filled && e.epoch == owner->cacheEpoch.load(boost::memory_order_acquire)
+        && e.stamp == owner->pathStamps[e.stripe].load(boost::memory_order_acquire)
+        && e.hash == hash && *e.type == typeid(TData) && e.idOverrides == idOverrides
+        && e.path == path && e.selfPath == selfPath && e.selfId == selfId)
+    {
+      if (getDefined)
+        *getDefined = e.defined;
+      if (!e.value)
+        return boost::none;
+      return static_cast<PTree::Record::TypedAs<TData> const&>(*e.value).value;
+    }
+
+    // a path of numbers alone depends on the segments before it, which
+    // differ between override candidates
+    size_t stripe = 0;
+    bool cacheable = PTree::pathStripe(path.data(), path.size(), stripe);
+    if (!cacheable && (!idOverrides || selfId.empty()))
+    {
+      stripe = PTree::stripeOf(PTree::joinPaths(selfPath, path));
+      cacheable = true;
+    }
+
+    bool defined = false;
+    boost::optional<TData> v;
+    boost::uint64_t epoch = 0;
+    boost::uint64_t stamp = 0;
+    {
+      PTree::ReadGuard g(*owner);
+      PTree::Record tmp;
+      PTree::Record const* r = find(path, tmp);
+      v = (r ? *r : tmp).get_as<TData>(&defined);
+      // writers are locked out, so the value belongs to these stamps
+      epoch = owner->cacheEpoch.load(boost::memory_order_relaxed);
+      stamp = owner->pathStamps[stripe].load(boost::memory_order_relaxed);
+      cacheable = cacheable && owner->sources.empty();
+    }
+
+    if (cacheable)
+    {
+      e.filled = true;
+      e.epoch = epoch;
+      e.stripe = stripe;
+      e.stamp = stamp;
+      e.hash = hash;
+      e.type = &typeid(TData);
+      e.idOverrides = idOverrides;
+      e.selfPath = selfPath;
+      e.selfId = selfId;
+      e.path = path;
+      e.defined = defined;
+      e.value.reset(v ? new PTree::Record::TypedAs<TData>(*v) : 0);
+    }
+    if (getDefined)
+      *getDefined = defined;
+    return v;
+  }
 
   template <typename TSelf>
   TSelf getSubtreeImpl(const std::string &path) const
   {
     assert(owner);
-    return TSelf(*owner, joinPaths(selfPath, path), selfId);
+    TSelf r(*owner, joinPaths(selfPath, path), selfId);
+    r.idOverrides = idOverrides;
+    return r;
+  }
+
+  // the caller holds the read guard
+  PTree::Record const* find(const std::string &path, PTree::Record & tmp,
+                            bool countReads = true) const
+  {
+    bool const tracking = countReads && owner->tracking.load(boost::memory_order_relaxed);
+    if (!tracking && !idOverrides)
+      return owner->findRecord(PTree::joinPaths(selfPath, path), tmp);
+
+    std::string fullPath;
+    PTree::Record const* r = 0;
+    if (idOverrides)
+      r = owner->findOverride(selfPath, selfId, path, tmp, &fullPath);
+    else
+    {
+      fullPath = PTree::joinPaths(selfPath, path);
+      r = owner->findRecord(fullPath, tmp);
+    }
+    if (tracking)
+      owner->countRead(fullPath);
+    return r;
+  }
+
+  static std::string relativeKey(std::string const& key, std::string const& prefix)
+  {
+    if (prefix.empty())
+      return key;
+    if (key.size() == prefix.size())
+      return "";
+    return key.substr(prefix.size() + 1); // to remove the path separator
   }
+
+  struct KeyCollector
+  {
+    std::vector<std::string> & result;
+    std::string const& prefix;
+    bool withUndefined;
+
+    KeyCollector(std::vector<std::string> & result, std::string const& prefix, bool withUndefined)
+    : result(result), prefix(prefix), withUndefined(withUndefined)
+    { }
+
+    void operator () (std::string const& key, PTree::Record const& r)
+    {
+      if (withUndefined || r.isDefined())
+        result.push_back(relativeKey(key, prefix));
+    }
+  };
+
+  struct RecordCollector
+  {
+    std::vector<PTree::Source::entry_t> & result;
+    std::string const& prefix;
+    bool withUndefined;
+
+    RecordCollector(std::vector<PTree::Source::entry_t> & result, std::string const& prefix, bool withUndefined)
+    : result(result), prefix(prefix), withUndefined(withUndefined)
+    { }
+
+    void operator () (std::string const& key, PTree::Record const& r)
+    {
+      if (withUndefined || r.isDefined())
+        result.push_back(PTree::Source::entry_t(relativeKey(key, prefix), r));
+    }
+  };
+
+  struct ChangeCollector
+  {
+    PTree::Batch & patch;
+    std::string const& prefix;
+    boost::uint64_t since;
+
+    ChangeCollector(PTree::Batch & patch, std::string const& prefix, boost::uint64_t since)
+    : patch(patch), prefix(prefix), since(since)
+    { }
+
+    void operator () (std::string const& key, PTree::Record const& r)
+    {
+      if (r.getVersion() <= since)
+        return;
+      if (r.isDefined())
+        patch.setRecord(relativeKey(key, prefix), r);
+      else
+        patch.undefine(relativeKey(key, prefix));
+    }
+  };
 };
 
 
@@ -343,37 +2549,74 @@ public:
   Ref()
   { }
 
-  void setRecord(const std::string &path, PTree::Record const& r)
+  void setRecord(const std::string &path, PTree::Record const& r) const
   {
-    assert(owner);
-    boost::lock_guard<boost::mutex> g(owner->mutex);
-    owner->getRecord(PTree::joinPaths(selfPath, path)) = r;
+    write(PTree::Batch::Entry(path, r, PTree::Batch::ASSIGN));
   }
 
   template <typename TData>
   void set(const std::string &path, const TData &value) const
   {
-    using boost::lexical_cast;
-    assert(owner);
-    boost::lock_guard<boost::mutex> g(owner->mutex);
-    owner->getRecord(PTree::joinPaths(selfPath, path)).set_as<TData>(value);
+    PTree::Batch::Entry e(path, PTree::Record(), PTree::Batch::UPDATE);
+    e.record.set_as<TData>(value);
+    write(e);
+  }
+
+  template <typename TData>
+  void setArray(const std::string &path, std::vector<TData> const& values) const
+  {
+    PTree::Batch::Entry e(path, PTree::Record(), PTree::Batch::UPDATE);
+    e.record.set_array_as<TData>(values);
+    write(e);
+  }
+
+  // the key alone gives TData: the value converts, as in set(kName, "front")
+  template <typename TData>
+  void set(Key<TData> const& key, typename Key<TData>::value_type const& value) const
+  {
+    set<TData>(key.toString(), value);
   }
 
   void undefine(const std::string &path) const
   {
-    using boost::lexical_cast;
-    assert(owner);
-    boost::lock_guard<boost::mutex> g(owner->mutex);
-    owner->getRecord(PTree::joinPaths(selfPath, path)).undefine();
+    write(PTree::Batch::Entry(path, PTree::Record(), PTree::Batch::UNDEFINE));
   }
 
   template <typename TData>
   void setValue(const TData &value) const
+  {
+    // a write: access tracking only counts reads
+    set<TData>("", value);
+  }
+
+  // Replaces the subtree at to with a copy of the defined records at from
+  // (both relative to this ref), sources included, under one lock.
+  void copySubtree(const std::string &from, const std::string &to) const
+  {
+    assert(owner);
+    owner->transfer(PTree::joinPaths(selfPath, from), PTree::joinPaths(selfPath, to), false);
+  }
+
+  // as copySubtree, then erases from; to must not lie within from
+  void moveSubtree(const std::string &from, const std::string &to) const
+  {
+    assert(owner);
+    owner->transfer(PTree::joinPaths(selfPath, from), PTree::joinPaths(selfPath, to), true);
+  }
+
+  // Removes the record at path and all records below it, freeing them;
+  // values of attached sources there are masked as undefined.
+  void eraseSubtree(const std::string &path) const
+  {
+    write(PTree::Batch::Entry(path, PTree::Record(), PTree::Batch::ERASE));
+  }
+
+  // applies all writes of the batch under one lock, notifying once
+  void apply(PTree::Batch const& batch) const
   {
     assert(owner);
-    boost::lock_guard<boost::mutex> g(owner->mutex);
-    // do not record access, for it's slow
-    owner->getRecord(selfPath).set_as<TData>(value);
+    if (!batch.empty())
+      owner->write(selfPath, &batch.getEntries()[0], batch.size());
   }
 
   PTree::Ref getSubtree(const std::string &path) const
@@ -396,6 +2639,13 @@ public:
     return r;
   }
 
+  Ref withIdOverrides(bool enable = true) const
+  {
+    Ref r = *this;
+    r.idOverrides = enable;
+    return r;
+  }
+
 
 protected:
   friend class PTree;
@@ -405,8 +2655,87 @@ protected:
       const std::string &selfId)
   : ConstRef(owner, selfPath, selfId)
   { }
+
+  void write(PTree::Batch::Entry const& e) const
+  {
+    assert(owner);
+    owner->write(selfPath, &e, 1);
+  }
+};
+
+
+// Another tree used as a source: reads take that tree's lock, or no lock
+// if it is frozen, and its undefined records mask the layers below.
+class PTree::Layer : public PTree::Source
+{
+public:
+  explicit Layer(boost::shared_ptr<PTree const> const& tree)
+  : tree(tree)
+  {
+    assert(this->tree);
+  }
+
+  virtual bool find(std::string const& path, Record & r) const
+  {
+    ReadGuard g(*tree);
+    Record tmp;
+    Record const* found = tree->findExact(path, tmp);
+    if (!found)
+      return false;
+    r = *found;
+    return true;
+  }
+
+  virtual void listRecords(std::string const& prefix, std::vector<entry_t> & result) const
+  {
+    ReadGuard g(*tree);
+    Collector c(result);
+    tree->visitSubtree(prefix, c);
+  }
+
+  virtual boost::uint64_t getVersion() const
+  {
+    return tree->version.load(boost::memory_order_acquire);
+  }
+
+private:
+  struct Collector
+  {
+    std::vector<entry_t> & result;
+
+    Collector(std::vector<entry_t> & result)
+    : result(result)
+    { }
+
+    void operator () (std::string const& key, Record const& r)
+    {
+      result.push_back(entry_t(key, r));
+    }
+  };
+
+  boost::shared_ptr<PTree const> tree;
 };
 
+inline PTree::Record const* PTree::NodeView::find(std::string const& path) const
+{
+  std::string const key = joinPaths(selfPath, path);
+  return entries ? findDefined(*entries, key) : findDefined(tree.propMap, key);
+}
+
+inline bool PTree::NodeView::listChildren(std::string const& path,
+                                          std::vector<std::string> & segments) const
+{
+  std::string const key = joinPaths(selfPath, path);
+  if (entries)
+    return listChildSegments(*entries, key, segments);
+  return listChildSegments(tree.propMap, key, segments);
+}
+
+inline PTree::PSource PTree::layer(boost::shared_ptr<PTree const> const& tree)
+{
+  return PSource(new Layer(tree));
+}
+
 
 inline PTree::ConstRef PTree::root(const std::string &id) const
 {
@@ -418,5 +2747,31 @@ inline PTree::Ref PTree::root(const std::string &id)
   return Ref(*this, "", id);
 }
 
+inline void PTree::diff(ConstRef const& from, ConstRef const& to, Batch & patch)
+{
+  std::vector<Source::entry_t> a, b;
+  from.listRecordsRecursive(a);
+  to.listRecordsRecursive(b);
+
+  std::vector<Source::entry_t>::const_iterator i = a.begin(), j = b.begin();
+  while (i != a.end() || j != b.end())
+  {
+    if (j == b.end() || (i != a.end() && i->first < j->first))
+      patch.undefine((i++)->first);
+    else if (i == a.end() || j->first < i->first)
+    {
+      patch.setRecord(j->first, j->second);
+      ++j;
+    }
+    else
+    {
+      if (!i->second.sameValue(j->second))
+        patch.setRecord(j->first, j->second);
+      ++i;
+      ++j;
+    }
+  }
+}
+
 
 } // namespace mxprops
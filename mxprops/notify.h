@@ -0,0 +1,99 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+#include "mxprops.h"
+#include <mxasync/base_messages.hpp>
+#include <mxasync/mq.hpp>
+
+
+namespace mxprops {
+
+// Sent to subscribers after a write batch changed values below their prefix
+class PropsChangedMessage : public mxasync::Message
+{
+public:
+  typedef std::vector<PTree::Source::entry_t> changes_t;
+
+  PropsChangedMessage(std::string const& prefix, changes_t const& changes)
+  : prefix(prefix),
+    changes(changes)
+  { }
+
+  std::string const& getPrefix() const { return prefix; }
+
+  // full paths with their new records; undefined if the value was removed
+  changes_t const& getChanges() const { return changes; }
+
+  virtual std::string toString() const
+  {
+    std::string r = "changed:";
+    for (size_t i = 0; i < changes.size(); ++i)
+      r += " " + changes[i].first;
+    return r;
+  }
+
+private:
+  std::string prefix;
+  changes_t changes;
+};
+DECLARE_PMESSAGE_TYPE(PropsChangedMessage);
+
+
+class MessageListener : public PTree::Listener
+{
+public:
+  MessageListener(mxasync::PMessageOutput const& out)
+  : out(out)
+  { }
+
+  virtual void onChange(std::string const& prefix,
+                        std::vector<PTree::Source::entry_t> const& changes)
+  {
+    out->push(mxasync::PMessage(new PropsChangedMessage(prefix, changes)));
+  }
+
+private:
+  mxasync::PMessageOutput out;
+};
+
+
+// Pushes a PropsChangedMessage to out for every write batch that changes
+// values at prefix or below; returns an id for PTree::removeListener.
+inline size_t subscribe(PTree & tree,
+                        std::string const& prefix,
+                        mxasync::PMessageOutput const& out)
+{
+  if (!out)
+    throw std::invalid_argument("null output");
+  return tree.addListener(prefix, PTree::PListener(new MessageListener(out)));
+}
+
+} // namespace mxprops
@@ -0,0 +1,211 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+#include "fieldset.h"
+#include <set>
+
+
+namespace mxprops {
+
+// Declared paths with their types, defaults and ranges, checked once after
+// loading rather than on every read:
+//
+//   Schema s;
+//   s.field<std::string>("camera.name")          // required
+//    .field("camera.gain", 1.0)                   // default if undefined
+//    .range("camera.fps", 1, 120, 25);            // [1, 120], default 25
+//   load_from_json_file(ref, messages, filename, s);
+//
+// apply() reports every missing, malformed or out-of-range value and then
+// writes nothing.  Otherwise the values, defaults included, are stored back
+// as typed records, so reading them with the declared type neither parses
+// nor fails.  The loaders taking a schema check the values they would write
+// before writing any.  Writes after apply() are not checked.
+class Schema
+{
+public:
+  Schema()
+  { }
+
+  template <typename TData>
+  Schema & field(std::string const& path)
+  {
+    return add(path, new Field<TData>(boost::optional<TData>(), boost::optional<TData>(), boost::optional<TData>()));
+  }
+
+  template <typename TData>
+  Schema & field(std::string const& path, TData const& defaultValue)
+  {
+    return add(path, new Field<TData>(defaultValue, boost::optional<TData>(), boost::optional<TData>()));
+  }
+
+  // minValue <= value <= maxValue
+  template <typename TData>
+  Schema & range(std::string const& path, TData const& minValue, TData const& maxValue)
+  {
+    return add(path, new Field<TData>(boost::optional<TData>(), minValue, maxValue));
+  }
+
+  template <typename TData>
+  Schema & range(std::string const& path, TData const& minValue, TData const& maxValue,
+                 TData const& defaultValue)
+  {
+    return add(path, new Field<TData>(defaultValue, minValue, maxValue));
+  }
+
+  bool empty() const { return fields.empty(); }
+
+  // Checks all declared paths under dst in one pass and writes the values
+  // back in one batch; false with a message per bad path otherwise, and
+  // nothing written.  The check does not count as reads for access tracking.
+  bool apply(PTree::Ref const& dst, std::vector<std::string> & messages) const
+  {
+    return apply(dst, PTree::Batch(), messages);
+  }
+
+  // The same for dst as it will be once staged is applied: the declared
+  // paths are checked on a copy of their records with staged applied over
+  // them, and only if all are good are staged and the typed values applied
+  // to dst, in one batch.
+  bool apply(PTree::Ref const& dst, PTree::Batch const& staged,
+             std::vector<std::string> & messages) const
+  {
+    PTree scratch;
+    PTree::Ref const copy = scratch.root("").getSubtree(dst.getPath());
+    copy.apply(readable(dst));
+    copy.apply(staged);
+
+    PTree::Batch batch = staged;
+    Checker c(batch);
+    if (!fields.check(copy, c, messages, false))
+      return false;
+    dst.apply(batch);
+    return true;
+  }
+
+private:
+  class FieldBase
+  {
+  public:
+    virtual ~FieldBase() { }
+
+    // r is 0 for a missing record; returns the error or an empty string
+    virtual char const* check(PTree::Record const* r, std::string const& path,
+                              PTree::Batch & batch) const = 0;
+  };
+
+  template <typename TData>
+  class Field : public FieldBase
+  {
+  public:
+    Field(boost::optional<TData> const& defaultValue,
+          boost::optional<TData> const& minValue,
+          boost::optional<TData> const& maxValue)
+    : defaultValue(defaultValue),
+      minValue(minValue),
+      maxValue(maxValue)
+    { }
+
+    virtual char const* check(PTree::Record const* r, std::string const& path,
+                              PTree::Batch & batch) const
+    {
+      if (!r || !r->isDefined())
+      {
+        if (!defaultValue)
+          return "Undefined property: ";
+        batch.setTyped<TData>(path, *defaultValue);
+        return "";
+      }
+      boost::optional<TData> const v = r->get_as<TData>();
+      if (!v)
+        return "Bad format ";
+      if ((minValue && *v < *minValue) || (maxValue && *maxValue < *v))
+        return "Out of range ";
+      batch.setTyped<TData>(path, *v);
+      return "";
+    }
+
+  private:
+    boost::optional<TData> defaultValue;
+    boost::optional<TData> minValue;
+    boost::optional<TData> maxValue;
+  };
+
+  struct Checker
+  {
+    PTree::Batch & batch;
+
+    explicit Checker(PTree::Batch & batch)
+    : batch(batch)
+    { }
+
+    char const* operator () (FieldBase const& f, std::string const& path, PTree::Record const* r)
+    {
+      return f.check(r, path, batch);
+    }
+  };
+
+  // the records of src the fields may read: each declared path with the
+  // records below it, and the array an index key like "roi.1" reads from
+  PTree::Batch readable(PTree::ConstRef const& src) const
+  {
+    std::vector<std::string> const& paths = fields.getPaths();
+    std::set<std::string> roots(paths.begin(), paths.end());
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+      size_t const dot = paths[i].rfind('.');
+      if (dot != std::string::npos && dot + 1 < paths[i].size()
+          && paths[i].find_first_not_of("0123456789", dot + 1) == std::string::npos)
+        roots.insert(paths[i].substr(0, dot));
+    }
+
+    PTree::Batch batch;
+    for (std::set<std::string>::const_iterator it = roots.begin(); it != roots.end(); ++it)
+    {
+      std::vector<PTree::Source::entry_t> records;
+      src.getSubtree(*it).listRecordsRecursive(records);
+      for (size_t i = 0; i < records.size(); ++i)
+        batch.setRecord(PTree::joinPaths(*it, records[i].first), records[i].second);
+    }
+    return batch;
+  }
+
+  Schema & add(std::string const& path, FieldBase *f)
+  {
+    fields.add(path, f);
+    return *this;
+  }
+
+  FieldSet<FieldBase> fields;
+};
+
+} // namespace mxprops
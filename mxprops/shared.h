@@ -0,0 +1,96 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+#include "mxprops.h"
+#include <boost/scoped_ptr.hpp>
+
+
+namespace mxprops {
+
+// A subtree published by one process into a named shared memory segment,
+// for any number of processes on the host to read without copies or
+// messages.  The segment holds two snapshot images: the writer fills the
+// one not in use, then switches readers over to it.  Readers take no lock;
+// each lookup checks the sequence number of the image it read and retries
+// if the writer has started refilling it meanwhile.  A reader lapped over
+// and over backs off to sleeping between retries, so a lookup may block
+// while the writer publishes, but it does not fail for that reason.
+class SharedTreeWriter : private boost::noncopyable
+{
+public:
+  // Creates the segment, replacing one of the same name, with room for
+  // images of up to capacity bytes; throws std::runtime_error on failure.
+  SharedTreeWriter(std::string const& name, size_t capacity);
+
+  // removes the name; readers that opened the segment keep their mapping
+  ~SharedTreeWriter();
+
+  // Replaces the published records with the defined records of src (keys
+  // relative to src); false if they do not fit.  Every publish serializes
+  // and copies the whole subtree, however little of it changed, so it costs
+  // time proportional to the image size: publish batches of changes rather
+  // than each one.
+  bool publish(PTree::ConstRef const& src, std::vector<std::string> & messages);
+
+  boost::uint64_t getVersion() const;
+
+private:
+  struct Impl;
+  boost::scoped_ptr<Impl> impl;
+};
+
+// Reading end, attached to a PTree as a source:
+//
+//   tree.attach(PTree::PSource(new SharedTree("mxprops.camera")), "shared");
+//
+// A tree with several sources revalidates its cached resolutions when
+// getVersion() changes, so publishes show up on the next read.
+class SharedTree : public PTree::Source
+{
+public:
+  // throws std::runtime_error if there is no such segment or it is malformed
+  explicit SharedTree(std::string const& name);
+  ~SharedTree();
+
+  size_t size() const;
+
+  virtual bool find(std::string const& path, PTree::Record & r) const;
+  virtual void listRecords(std::string const& prefix,
+                           std::vector<PTree::Source::entry_t> & result) const;
+  virtual boost::uint64_t getVersion() const;
+
+private:
+  struct Impl;
+  boost::scoped_ptr<Impl> impl;
+};
+
+}
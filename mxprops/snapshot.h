@@ -0,0 +1,88 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+#include "mxprops.h"
+#include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+
+
+namespace mxprops {
+
+// Compact binary image of a PTree subtree: a header, a key table sorted the
+// same way as PTree keys, a path data table and a pool of strings and
+// numbers.  Integers and reals are stored as 64-bit payloads and come back
+// as records that get_as<int> or get_as<double> reads without parsing.  The
+// file is used in place through a read-only memory mapping, so processes
+// attaching to the same snapshot share its pages.
+class Snapshot : public PTree::Source
+{
+public:
+  enum ValueType
+  {
+    StringValue  = 0,
+    IntegerValue = 1,
+    RealValue    = 2,
+    ArrayValue   = 3
+  };
+
+  // throws std::runtime_error if the file cannot be mapped or is malformed
+  explicit Snapshot(std::string const& filename);
+  ~Snapshot();
+
+  size_t size() const;
+
+  // type detected when the snapshot was written; StringValue if absent, and
+  // for numbers that do not read back as the same string, like "007"
+  ValueType getType(std::string const& path) const;
+
+  virtual bool find(std::string const& path, PTree::Record & r) const;
+  virtual void listRecords(std::string const& prefix,
+                           std::vector<PTree::Source::entry_t> & result) const;
+
+private:
+  struct Impl;
+  boost::scoped_ptr<Impl> impl;
+};
+
+typedef boost::shared_ptr<Snapshot const> PSnapshot;
+
+// Writes the defined records of src, with keys relative to src.
+bool save_snapshot(mxprops::PTree::ConstRef const& src,
+                   std::vector<std::string> & messages,
+                   std::string const& filename);
+
+// Copies all records of a snapshot into dst; use PTree::attach instead
+// to read them in place.
+bool load_snapshot(mxprops::PTree::Ref const& dst,
+                   std::vector<std::string> & messages,
+                   std::string const& filename);
+
+}
@@ -1,31 +1,136 @@
 #define MXPROPS_EXPORTS
 #include "../io.h"
+#include "snapshot_format.h"
 #include <json-cpp/value.h>
 #include <json-cpp/reader.h>
 #include <sstream>
 #include <fstream>
-#include <boost/algorithm/string/trim.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
 
 
 namespace mxprops {
 
+static bool is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+}
+
+static void trim(char const*& b, char const*& e)
+{
+  while (b != e && is_blank(*b))
+    ++b;
+  while (e != b && is_blank(e[-1]))
+    --e;
+}
+
+// Splits the line [b, e) into a trimmed name [b, nameEnd) and a trimmed
+// value [value, e); false for a blank or comment line, throws for a line
+// without '='.
+static bool scan_prop_line(char const*& b, char const*& e,
+                           char const*& nameEnd, char const*& value)
+{
+  trim(b, e);
+  if (b == e || *b == '#')
+    return false;
+
+  char const* eq = static_cast<char const*>(std::memchr(b, '=', e - b));
+  if (!eq)
+    throw std::runtime_error("Bad syntax: cannot find '=' in string: " + std::string(b, e));
+  nameEnd = eq;
+  value = eq + 1;
+  char const* nameBegin = b;
+  trim(nameBegin, nameEnd);
+  trim(value, e);
+  return true;
+}
+
+// the size of the file behind an open mapping, or -1 if unknown
+static boost::intmax_t mapped_file_size(boost::interprocess::file_mapping const& file)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  struct stat st;
+  if (fstat(file.get_mapping_handle().handle, &st) == 0)
+    return st.st_size;
+#elif defined(_WIN32)
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(file.get_mapping_handle().handle, &size))
+    return size.QuadPart;
+#endif
+  return -1;
+}
+
 static void add_prop_line(mxprops::PTree::Ref const& dst,
                           std::string const& line)
 {
-  std::string trimmed = line;
-  boost::trim(trimmed);
-  if (line.empty() || line[0] == '#')
-    return;
+  char const* b = line.data();
+  char const* e = b + line.size();
+  char const *nameEnd, *value;
+  if (scan_prop_line(b, e, nameEnd, value))
+    dst.set(std::string(b, nameEnd), std::string(value, e));
+}
+
+static void add_prop_line(mxprops::PTree::Batch & batch,
+                          std::string const& line)
+{
+  char const* b = line.data();
+  char const* e = b + line.size();
+  char const *nameEnd, *value;
+  if (scan_prop_line(b, e, nameEnd, value))
+    batch.set(std::string(b, nameEnd), std::string(value, e));
+}
 
-  size_t const eqPos = trimmed.find('=');
-  if (eqPos == std::string::npos)
-    throw std::runtime_error("Bad syntax: cannot find '=' in string: " + trimmed);
-  std::string namePart = trimmed.substr(0, eqPos);
-  boost::trim_right(namePart);
-  std::string valuePart = trimmed.substr(eqPos + 1);
-  boost::trim_right(valuePart);
+static void unknown_arg(int i, char const* arg)
+{
+  std::ostringstream oss;
+  oss << "unknown arg #" << i << ": '" << arg << "'";
+  throw std::runtime_error(oss.str());
+}
 
-  dst.set(namePart, valuePart);
+// Converts an array of scalars the same way scalar members are stored;
+// false if any element is not a scalar.
+static bool json_array_to_elements(Json::Value const& v,
+                                   PTree::Record::elements_t & elements)
+{
+  elements.reserve(v.size());
+  for (Json::Value::ArrayIndex ai = 0; ai < v.size(); ++ai)
+  {
+    Json::Value const& e = v[ai];
+    PTree::Record r;
+    switch (e.type())
+    {
+    case Json::intValue:
+      r.set_as(e.asInt());
+      break;
+    case Json::uintValue:
+      r.set_as(e.asUInt());
+      break;
+    case Json::realValue:
+      r.set_as(e.asDouble());
+      break;
+    case Json::stringValue:
+      r.set_as(e.asString());
+      break;
+    case Json::booleanValue:
+      r.set_as<int>(e.asBool());
+      break;
+    default:
+      return false;
+    }
+    elements.push_back(r.getValue());
+  }
+  return true;
 }
 
 bool load_from_command_line(mxprops::PTree::Ref const& dst,
@@ -38,15 +143,9 @@ bool load_from_command_line(mxprops::PTree::Ref const& dst,
     for (int i = 1; i < argc; ++i)
     {
       if (argv[i][0] == '-')
-      {
         add_prop_line(dst, argv[i] + 1);
-      }
       else
-      {
-        std::ostringstream oss;
-        oss << "unknown arg #" << i << ": '" << argv[i] << "'";
-        throw std::runtime_error(oss.str());
-      }
+        unknown_arg(i, argv[i]);
     }
     return true;
   }
@@ -57,50 +156,112 @@ bool load_from_command_line(mxprops::PTree::Ref const& dst,
   }
 }
 
-bool load_from_json(mxprops::PTree::Ref const& dst,
-                    std::vector<std::string> & messages,
-                    Json::Value const& doc)
+bool load_from_properties_file(mxprops::PTree::Ref const& dst,
+                               std::vector<std::string> & messages,
+                               std::string const& filename)
+{
+  PTree::Batch batch;
+  size_t lineNo = 0;
+  try
+  {
+    boost::interprocess::file_mapping file(filename.c_str(), boost::interprocess::read_only);
+    // an empty file cannot be mapped; its size comes from the open handle
+    if (mapped_file_size(file) == 0)
+      return true;
+
+    boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+    char const* p = static_cast<char const*>(region.get_address());
+    char const* const end = p + region.get_size();
+    while (p != end)
+    {
+      ++lineNo;
+      char const* eol = static_cast<char const*>(std::memchr(p, '\n', end - p));
+      if (!eol)
+        eol = end;
+      char const* b = p;
+      char const* e = eol;
+      char const *nameEnd, *value;
+      if (scan_prop_line(b, e, nameEnd, value))
+        batch.set(std::string(b, nameEnd), std::string(value, e));
+      p = eol == end ? end : eol + 1;
+    }
+  }
+  catch (boost::interprocess::interprocess_exception const& e)
+  {
+    messages.push_back("Failed to map properties file " + filename + ": " + e.what());
+    return false;
+  }
+  catch (std::runtime_error const& e)
+  {
+    std::ostringstream oss;
+    oss << filename << ":" << lineNo << ": " << e.what();
+    messages.push_back(oss.str());
+    return false;
+  }
+
+  dst.apply(batch);
+  return true;
+}
+
+// Collects the writes load_from_json() makes, with paths below prefix, so a
+// document can be converted without touching the tree.
+static bool json_to_batch(std::string const& prefix,
+                          std::vector<std::string> & messages,
+                          Json::Value const& doc,
+                          PTree::Batch & batch)
 {
   std::vector<std::string> members = doc.getMemberNames();
   for (size_t i = 0; i < members.size(); ++i)
   {
-    std::string const& n = members[i];
-    Json::Value const& v = doc[n];
+    std::string const n = PTree::joinPaths(prefix, members[i]);
+    Json::Value const& v = doc[members[i]];
     Json::ValueType const ty = v.type();
 
     switch (ty)
     {
     case Json::objectValue:
-      if (!load_from_json(dst.getSubtree(n), messages, v))
+      if (!json_to_batch(n, messages, v, batch))
         return false;
       break;
 
     case Json::arrayValue:
       {
+        PTree::Record::elements_t elements;
+        if (json_array_to_elements(v, elements))
+        {
+          PTree::Record r;
+          r.setElementsConverted(elements);
+          batch.setRecord(n, r);
+          break;
+        }
+
+        // arrays of objects, nested arrays or nulls keep the index-key layout
         Json::Value objv(Json::objectValue);
-        for (size_t ai = 0; ai < v.size(); ++ai)
+        for (Json::Value::ArrayIndex ai = 0; ai < v.size(); ++ai)
           objv[boost::lexical_cast<std::string>(ai)] = v[ai];
-        return load_from_json(dst, messages, objv);
+        if (!json_to_batch(n, messages, objv, batch))
+          return false;
+        break;
       }
 
     case Json::nullValue:
-      dst.undefine(n);
+      batch.undefine(n);
       break;
 
     case Json::intValue:
-      dst.set(n, v.asInt());
+      batch.set(n, v.asInt());
       break;
     case Json::uintValue:
-      dst.set(n, v.asUInt());
+      batch.set(n, v.asUInt());
       break;
     case Json::realValue:
-      dst.set(n, v.asDouble());
+      batch.set(n, v.asDouble());
       break;
     case Json::stringValue:
-      dst.set(n, v.asString());
+      batch.set(n, v.asString());
       break;
     case Json::booleanValue:
-      dst.set<int>(n, v.asBool());
+      batch.set<int>(n, v.asBool());
       break;
 
     default:
@@ -111,10 +272,21 @@ bool load_from_json(mxprops::PTree::Ref const& dst,
   return true;
 }
 
+bool load_from_json(mxprops::PTree::Ref const& dst,
+                    std::vector<std::string> & messages,
+                    Json::Value const& doc)
+{
+  // nothing is written unless the whole document converts
+  PTree::Batch batch;
+  if (!json_to_batch("", messages, doc, batch))
+    return false;
+  dst.apply(batch);
+  return true;
+}
 
-bool load_from_json_file(mxprops::PTree::Ref const& dst,
-                         std::vector<std::string> & messages,
-                         std::string const& filename)
+static bool json_file_to_batch(std::string const& filename,
+                               std::vector<std::string> & messages,
+                               PTree::Batch & batch)
 {
   Json::Reader reader;
   Json::Value doc(Json::objectValue);
@@ -125,27 +297,641 @@ bool load_from_json_file(mxprops::PTree::Ref const& dst,
                        + reader.getFormatedErrorMessages());
     return false;
   }
-  return load_from_json(dst, messages, doc);
+  return json_to_batch("", messages, doc, batch);
+}
+
+bool load_from_json_file(mxprops::PTree::Ref const& dst,
+                         std::vector<std::string> & messages,
+                         std::string const& filename)
+{
+  PTree::Batch batch;
+  if (!json_file_to_batch(filename, messages, batch))
+    return false;
+  dst.apply(batch);
+  return true;
+}
+
+namespace {
+
+// A file parsed off the tree: its writes wait in the batch until the files
+// before it have been applied.
+struct StagedFile
+{
+  std::string filename;
+  PTree::Batch batch;
+  std::vector<std::string> messages;
+  bool ok;
+
+  explicit StagedFile(std::string const& filename)
+  : filename(filename), ok(false)
+  { }
+};
+
+void stage_json_file(StagedFile & file)
+{
+  try
+  {
+    file.ok = json_file_to_batch(file.filename, file.messages, file.batch);
+  }
+  catch (std::exception const& e)
+  {
+    file.messages.push_back("Failed to load json file " + file.filename + ": " + e.what());
+    file.ok = false;
+  }
+}
+
+// takes the next unclaimed file until none are left
+struct StageWorker
+{
+  std::vector<StagedFile> & files;
+  boost::atomic<size_t> & next;
+
+  StageWorker(std::vector<StagedFile> & files, boost::atomic<size_t> & next)
+  : files(files), next(next)
+  { }
+
+  void operator () () const
+  {
+    for (size_t i = next++; i < files.size(); i = next++)
+      stage_json_file(files[i]);
+  }
+};
+
+// Parses the files concurrently, on at most one thread per core; the tree
+// is not touched, so the merge order is up to the caller.
+void stage_json_files(std::vector<StagedFile> & files)
+{
+  size_t const threads = std::min<size_t>(files.size(),
+                                          std::max(1u, boost::thread::hardware_concurrency()));
+  boost::atomic<size_t> next(0);
+  StageWorker const worker(files, next);
+  if (threads <= 1)
+  {
+    worker();
+    return;
+  }
+  boost::thread_group group;
+  for (size_t i = 0; i < threads; ++i)
+    group.create_thread(worker);
+  group.join_all();
+}
+
+} // namespace
+
+bool load_from_json_files(mxprops::PTree::Ref const& dst,
+                          std::vector<std::string> & messages,
+                          std::vector<std::string> const& filenames)
+{
+  std::vector<StagedFile> files(filenames.begin(), filenames.end());
+  stage_json_files(files);
+
+  // applied in order and up to the first failure, exactly as loading the
+  // files one by one would
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    messages.insert(messages.end(), files[i].messages.begin(), files[i].messages.end());
+    if (!files[i].ok)
+      return false;
+    dst.apply(files[i].batch);
+  }
+  return true;
+}
+
+// the schema overloads check the staged writes before any reaches dst
+bool load_from_command_line(mxprops::PTree::Ref const& dst,
+                            std::vector<std::string> & messages,
+                            int argc,
+                            char const* argv[],
+                            Schema const& schema)
+{
+  PTree::Batch batch;
+  try
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      if (argv[i][0] == '-')
+        add_prop_line(batch, argv[i] + 1);
+      else
+        unknown_arg(i, argv[i]);
+    }
+  }
+  catch (std::runtime_error const& e)
+  {
+    messages.push_back(e.what());
+    return false;
+  }
+  return schema.apply(dst, batch, messages);
+}
+
+bool load_from_json(mxprops::PTree::Ref const& dst,
+                    std::vector<std::string> & messages,
+                    Json::Value const& doc,
+                    Schema const& schema)
+{
+  PTree::Batch batch;
+  return json_to_batch("", messages, doc, batch)
+      && schema.apply(dst, batch, messages);
+}
+
+bool load_from_json_file(mxprops::PTree::Ref const& dst,
+                         std::vector<std::string> & messages,
+                         std::string const& filename,
+                         Schema const& schema)
+{
+  PTree::Batch batch;
+  return json_file_to_batch(filename, messages, batch)
+      && schema.apply(dst, batch, messages);
+}
+
+void batch_to_json(mxprops::PTree::Batch const& batch,
+                   Json::Value & doc)
+{
+  doc = Json::Value(Json::arrayValue);
+  PTree::Batch::entries_t const& entries = batch.getEntries();
+  for (size_t i = 0; i < entries.size(); ++i)
+  {
+    PTree::Record const& r = entries[i].record;
+    Json::Value e(Json::objectValue);
+    e["path"] = entries[i].path;
+    if (entries[i].op == PTree::Batch::ERASE)
+      e["erased"] = true;
+    else if (entries[i].op == PTree::Batch::UNDEFINE || !r.isDefined())
+      e["undefined"] = true;
+    else if (r.isArray())
+    {
+      Json::Value elements(Json::arrayValue);
+      PTree::Record::elements_t const& v = r.getElements();
+      for (size_t k = 0; k < v.size(); ++k)
+        elements.append(v[k]);
+      e["elements"] = elements;
+    }
+    else
+      e["value"] = r.getValue();
+    doc.append(e);
+  }
+}
+
+bool batch_from_json(Json::Value const& doc,
+                     mxprops::PTree::Batch & batch,
+                     std::vector<std::string> & messages)
+{
+  if (!doc.isArray())
+  {
+    messages.push_back("batch is not a json array");
+    return false;
+  }
+  for (Json::Value::ArrayIndex ai = 0; ai < doc.size(); ++ai)
+  {
+    Json::Value const& e = doc[ai];
+    if (!e.isObject() || !e["path"].isString())
+    {
+      std::ostringstream oss;
+      oss << "batch entry #" << ai << " has no path";
+      messages.push_back(oss.str());
+      return false;
+    }
+    std::string const path = e["path"].asString();
+    if (e["value"].isString())
+      batch.set(path, e["value"].asString());
+    else if (e["elements"].isArray())
+    {
+      std::vector<std::string> elements;
+      for (Json::Value::ArrayIndex k = 0; k < e["elements"].size(); ++k)
+        elements.push_back(e["elements"][k].asString());
+      batch.setArray(path, elements);
+    }
+    else if (e["undefined"].asBool())
+      batch.undefine(path);
+    else if (e["erased"].asBool())
+      batch.erase(path);
+    else
+    {
+      messages.push_back("bad batch entry for " + path);
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {
+
+// Output collected in a buffer and handed to the sink in large pieces.
+class Writer
+{
+public:
+  Writer(std::ostream *out, int fd)
+  : out(out), fd(fd), ok(true)
+  {
+    buffer.reserve(CHUNK + 1024);
+  }
+
+  void put(char c)
+  {
+    buffer += c;
+    if (buffer.size() >= CHUNK)
+      flush();
+  }
+
+  void put(std::string const& s)
+  {
+    buffer += s;
+    if (buffer.size() >= CHUNK)
+      flush();
+  }
+
+  bool flush()
+  {
+    if (out)
+      ok = out->write(buffer.data(), buffer.size()) && ok;
+#if defined(__unix__) || defined(__APPLE__)
+    else
+    {
+      size_t done = 0;
+      while (ok && done < buffer.size())
+      {
+        ssize_t const n = ::write(fd, buffer.data() + done, buffer.size() - done);
+        if (n > 0)
+          done += n;
+        else if (n < 0 && errno != EINTR)
+          ok = false;
+      }
+    }
+#endif
+    buffer.clear();
+    return ok;
+  }
+
+private:
+  static size_t const CHUNK = 64 * 1024;
+
+  std::ostream *out;
+  int fd;
+  std::string buffer;
+  bool ok;
+};
+
+void put_json_string(Writer & w, std::string const& s)
+{
+  w.put('"');
+  for (size_t i = 0; i < s.size(); ++i)
+  {
+    char const c = s[i];
+    switch (c)
+    {
+    case '"':  w.put("\\\""); break;
+    case '\\': w.put("\\\\"); break;
+    case '\n': w.put("\\n"); break;
+    case '\r': w.put("\\r"); break;
+    case '\t': w.put("\\t"); break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20)
+      {
+        char escaped[8];
+        std::sprintf(escaped, "\\u%04x", static_cast<unsigned>(c));
+        w.put(escaped);
+      }
+      else
+        w.put(c);
+    }
+  }
+  w.put('"');
+}
+
+// Numbers bare only when load_from_json reads them back as the same
+// string: it stores a json integer in its canonical form and any other
+// number as the shortest double, so "007", "1.50" or "1e3" are quoted.
+bool is_canonical_number(std::string const& v)
+{
+  bool isInteger = false;
+  if (!snapshot_format::parse_number(v, isInteger))
+    return false;
+  if (isInteger)
+  {
+    boost::optional<int> const i = Converter<int>::parse(v);
+    if (i)
+      return *Converter<int>::format(*i) == v;
+    boost::optional<unsigned> const u = Converter<unsigned>::parse(v);
+    return u && *Converter<unsigned>::format(*u) == v;
+  }
+  boost::optional<double> const d = Converter<double>::parse(v);
+  return d && *Converter<double>::format(*d) == v;
+}
+
+void put_json_scalar(Writer & w, std::string const& v)
+{
+  if (is_canonical_number(v))
+    w.put(v);
+  else
+    put_json_string(w, v);
+}
+
+void put_json_record(Writer & w, PTree::Record const& r)
+{
+  if (!r.isArray())
+  {
+    put_json_scalar(w, r.getValue());
+    return;
+  }
+  PTree::Record::elements_t const& elements = r.getElements();
+  w.put('[');
+  for (size_t i = 0; i < elements.size(); ++i)
+  {
+    if (i)
+      w.put(", ");
+    put_json_scalar(w, elements[i]);
+  }
+  w.put(']');
+}
+
+void put_indent(Writer & w, size_t depth)
+{
+  w.put('\n');
+  for (size_t i = 0; i < depth; ++i)
+    w.put("  ");
+}
+
+// indices of the segments in array order if they are exactly 0..n-1
+bool as_array(std::vector<std::string> const& segments, std::vector<size_t> & order)
+{
+  order.assign(segments.size(), segments.size());
+  for (size_t i = 0; i < segments.size(); ++i)
+  {
+    std::string const& s = segments[i];
+    if (s.empty() || s.size() > 9 || (s[0] == '0' && s.size() > 1)
+        || s.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    size_t const index = std::atoi(s.c_str());
+    if (index >= segments.size() || order[index] != segments.size())
+      return false;
+    order[index] = i;
+  }
+  return true;
 }
 
+bool put_json_value(Writer & w, PTree::NodeView const& view, std::string const& path,
+                    size_t depth, std::string & bad);
+
+// Writes a container for the children of the node at path; own is the
+// record of the node itself or 0.  False if a key below it has an empty
+// segment, which json has no way to tell from the node's own "" member;
+// bad is then the node where it was met.
+bool put_json_node(Writer & w, PTree::NodeView const& view, std::string const& path,
+                   PTree::Record const* own, std::vector<std::string> const& segments,
+                   size_t depth, std::string & bad, bool isObject = false)
+{
+  std::vector<size_t> order;
+  bool const isArray = !own && !isObject && as_array(segments, order);
+
+  w.put(isArray ? '[' : '{');
+  bool first = true;
+  if (own)
+  {
+    put_indent(w, depth + 1);
+    w.put("\"\": ");
+    put_json_record(w, *own);
+    first = false;
+  }
+  for (size_t n = 0; n < segments.size(); ++n)
+  {
+    std::string const& segment = segments[isArray ? order[n] : n];
+    if (!first)
+      w.put(',');
+    first = false;
+    put_indent(w, depth + 1);
+    if (!isArray)
+    {
+      put_json_string(w, segment);
+      w.put(": ");
+    }
+    if (!put_json_value(w, view, PTree::joinPaths(path, segment), depth + 1, bad))
+      return false;
+  }
+  if (!first)
+    put_indent(w, depth);
+  w.put(isArray ? ']' : '}');
+  return true;
+}
+
+// the node at path, which has a record or children, unless all the records
+// below it have an empty next segment
+bool put_json_value(Writer & w, PTree::NodeView const& view, std::string const& path,
+                    size_t depth, std::string & bad)
+{
+  std::vector<std::string> segments;
+  bool const complete = view.listChildren(path, segments);
+  PTree::Record const* own = view.find(path);
+  if (!complete || (!own && segments.empty()))
+  {
+    bad = path;
+    return false;
+  }
+  if (segments.empty())
+  {
+    put_json_record(w, *own);
+    return true;
+  }
+  return put_json_node(w, view, path, own, segments, depth, bad);
+}
+
+struct JsonExporter
+{
+  Writer & w;
+  bool ok;
+  std::string bad;
+
+  explicit JsonExporter(Writer & w)
+  : w(w), ok(true)
+  { }
+
+  void operator () (PTree::NodeView const& view)
+  {
+    // the root stays an object, as load_from_json expects
+    std::vector<std::string> segments;
+    ok = view.listChildren("", segments)
+      && put_json_node(w, view, "", view.find(""), segments, 0, bad, true);
+  }
+};
+
+// The records at and below path as key=value lines, array elements as
+// index keys; false as put_json_node.
+bool put_properties(Writer & w, PTree::NodeView const& view, std::string const& path,
+                    std::string & bad)
+{
+  PTree::Record const* own = view.find(path);
+  if (own && !own->isArray())
+  {
+    w.put(path);
+    w.put('=');
+    w.put(own->getValue());
+    w.put('\n');
+  }
+  else if (own)
+  {
+    PTree::Record::elements_t const& elements = own->getElements();
+    for (size_t k = 0; k < elements.size(); ++k)
+    {
+      w.put(PTree::joinPaths(path, boost::lexical_cast<std::string>(k)));
+      w.put('=');
+      w.put(elements[k]);
+      w.put('\n');
+    }
+  }
+
+  std::vector<std::string> segments;
+  if (!view.listChildren(path, segments))
+  {
+    bad = path;
+    return false;
+  }
+  for (size_t i = 0; i < segments.size(); ++i)
+    if (!put_properties(w, view, PTree::joinPaths(path, segments[i]), bad))
+      return false;
+  return true;
+}
+
+struct PropertiesExporter
+{
+  Writer & w;
+  bool ok;
+  std::string bad;
+
+  explicit PropertiesExporter(Writer & w)
+  : w(w), ok(true)
+  { }
+
+  void operator () (PTree::NodeView const& view)
+  {
+    ok = put_properties(w, view, "", bad);
+  }
+};
+
+std::string empty_segment_message(std::string const& bad)
+{
+  return "Cannot write keys with an empty segment, found below '" + bad + "'";
+}
+
+// The tree is walked node by node under its read lock, writing as it goes,
+// so a slow sink holds off writers of an unfrozen tree.  target names the
+// sink in the failure message.
+bool write_json(PTree::ConstRef const& src, std::vector<std::string> & messages,
+                std::ostream *out, int fd, std::string const& target)
+{
+  Writer w(out, fd);
+  JsonExporter e(w);
+  src.visitNodes(e);
+  w.put('\n');
+  if (!e.ok)
+  {
+    messages.push_back(empty_segment_message(e.bad));
+    return false;
+  }
+  if (!w.flush())
+  {
+    messages.push_back("Failed to write " + target);
+    return false;
+  }
+  return true;
+}
+
+bool write_properties(PTree::ConstRef const& src, std::vector<std::string> & messages,
+                      std::ostream *out, int fd, std::string const& target)
+{
+  Writer w(out, fd);
+  PropertiesExporter e(w);
+  src.visitNodes(e);
+  if (!e.ok)
+  {
+    messages.push_back(empty_segment_message(e.bad));
+    return false;
+  }
+  if (!w.flush())
+  {
+    messages.push_back("Failed to write " + target);
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+bool save_to_json(mxprops::PTree::ConstRef const& src,
+                  std::vector<std::string> & messages,
+                  std::ostream & out)
+{
+  return write_json(src, messages, &out, -1, "json");
+}
+
+bool save_to_json_file(mxprops::PTree::ConstRef const& src,
+                       std::vector<std::string> & messages,
+                       std::string const& filename)
+{
+  std::ofstream f(filename.c_str(), std::ios::binary | std::ios::trunc);
+  if (!f.is_open())
+  {
+    messages.push_back("Failed to open json file " + filename);
+    return false;
+  }
+  return write_json(src, messages, &f, -1, "json file " + filename);
+}
+
+bool save_to_properties(mxprops::PTree::ConstRef const& src,
+                        std::vector<std::string> & messages,
+                        std::ostream & out)
+{
+  return write_properties(src, messages, &out, -1, "properties");
+}
+
+bool save_to_properties_file(mxprops::PTree::ConstRef const& src,
+                             std::vector<std::string> & messages,
+                             std::string const& filename)
+{
+  std::ofstream f(filename.c_str(), std::ios::binary | std::ios::trunc);
+  if (!f.is_open())
+  {
+    messages.push_back("Failed to open properties file " + filename);
+    return false;
+  }
+  return write_properties(src, messages, &f, -1, "properties file " + filename);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+bool save_to_json(mxprops::PTree::ConstRef const& src,
+                  std::vector<std::string> & messages,
+                  int fd)
+{
+  return write_json(src, messages, 0, fd, "json");
+}
+
+bool save_to_properties(mxprops::PTree::ConstRef const& src,
+                        std::vector<std::string> & messages,
+                        int fd)
+{
+  return write_properties(src, messages, 0, fd, "properties");
+}
+#endif
+
 void init_settings_from_command_line(mxprops::PTree::Ref const& dst,
                                      int argc,
                                      char const* argv[])
 {
-  std::vector<std::string> messages;
+  std::vector<StagedFile> files;
+  for (int i = 1; i < argc; ++i)
+    if (argv[i][0] != '-')
+      files.push_back(StagedFile(argv[i]));
+  stage_json_files(files);
 
+  std::vector<StagedFile>::iterator file = files.begin();
   for (int i = 1; i < argc; ++i)
   {
     if (argv[i][0] == '-')
     {
       add_prop_line(dst, argv[i] + 1);
+      continue;
     }
-    else if (!load_from_json_file(dst, messages, argv[i]))
-    {
-      std::ostringstream oss;
-      oss << "unknown arg #" << i << ": '" << argv[i] << "'";
-      throw std::runtime_error(oss.str());
-    }
+    // a file that fails is not applied, as in load_from_json_files
+    if (!file->ok)
+      unknown_arg(i, argv[i]);
+    dst.apply((file++)->batch);
   }
 }
 
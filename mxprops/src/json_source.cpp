@@ -0,0 +1,494 @@
+#define MXPROPS_EXPORTS
+#include "../json_source.h"
+#include <json-cpp/value.h>
+#include <json-cpp/reader.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+
+namespace mxprops {
+
+namespace {
+
+// offsets of an object or array: its opening and its closing bracket
+struct Span
+{
+  size_t begin;
+  size_t end;
+
+  bool operator < (Span const& other) const { return begin < other.begin; }
+};
+
+// an object or array whose members are records once loaded
+struct Container
+{
+  size_t begin;
+  bool loaded;
+
+  explicit Container(size_t begin)
+  : begin(begin), loaded(false)
+  { }
+};
+
+bool is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool is_delimiter(char c)
+{
+  return is_blank(c) || c == ',' || c == '}' || c == ']' || c == '/';
+}
+
+} // namespace
+
+
+struct JsonSource::Impl
+{
+  typedef std::map<std::string, Container> containers_t;
+  typedef std::map<std::string, PTree::Record> records_t;
+
+  std::string filename;
+  boost::interprocess::file_mapping file;
+  boost::interprocess::mapped_region region;
+  char const* base;
+  size_t size;
+  std::vector<Span> index; // ordered by begin
+
+  // Lookups are const but materialize records: they share the lock while
+  // what they need is loaded and only take it exclusively to load.
+  boost::shared_mutex mutex;
+  containers_t containers;
+  records_t records;
+
+  Impl(std::string const& filename)
+  : filename(filename),
+    file(filename.c_str(), boost::interprocess::read_only),
+    region(file, boost::interprocess::read_only),
+    base(static_cast<char const*>(region.get_address())),
+    size(region.get_size())
+  {
+    buildIndex();
+    containers.insert(std::make_pair(std::string(), Container(index[0].begin)));
+  }
+
+  void fail(size_t pos, char const* what) const
+  {
+    std::ostringstream oss;
+    oss << "Malformed json file " << filename << " at offset " << pos << ": " << what;
+    throw std::runtime_error(oss.str());
+  }
+
+  // position of the first character that is neither blank nor in a comment
+  size_t skipBlanks(size_t p) const
+  {
+    while (p < size)
+    {
+      if (is_blank(base[p]))
+        ++p;
+      else if (base[p] == '/' && p + 1 < size && base[p + 1] == '/')
+      {
+        char const* eol = static_cast<char const*>(std::memchr(base + p, '\n', size - p));
+        p = eol ? eol - base + 1 : size;
+      }
+      else if (base[p] == '/' && p + 1 < size && base[p + 1] == '*')
+      {
+        size_t q = p + 2;
+        while (q + 1 < size && !(base[q] == '*' && base[q + 1] == '/'))
+          ++q;
+        if (q + 1 >= size)
+          fail(p, "unterminated comment");
+        p = q + 2;
+      }
+      else
+        break;
+    }
+    return p;
+  }
+
+  // position after the closing quote of the string starting at p
+  size_t skipString(size_t p) const
+  {
+    for (size_t q = p + 1; q < size; ++q)
+    {
+      if (base[q] == '\\')
+        ++q;
+      else if (base[q] == '"')
+        return q + 1;
+    }
+    fail(p, "unterminated string");
+    return size;
+  }
+
+  // One pass over the file matching brackets; strings and comments are
+  // skipped so the brackets inside them do not count.
+  void buildIndex()
+  {
+    std::vector<size_t> open;
+    size_t p = skipBlanks(0);
+    if (p == size || base[p] != '{')
+      fail(p, "the root is not an object");
+
+    while (p < size)
+    {
+      char const c = base[p];
+      if (c == '"')
+      {
+        p = skipString(p);
+        continue;
+      }
+      if (c == '/')
+      {
+        size_t const q = skipBlanks(p);
+        if (q != p)
+        {
+          p = q;
+          continue;
+        }
+      }
+      else if (c == '{' || c == '[')
+      {
+        open.push_back(index.size());
+        Span s = { p, 0 };
+        index.push_back(s);
+      }
+      else if (c == '}' || c == ']')
+      {
+        if (open.empty() || base[index[open.back()].begin] != (c == '}' ? '{' : '['))
+          fail(p, "unbalanced brackets");
+        index[open.back()].end = p;
+        open.pop_back();
+        if (open.empty())
+        {
+          if (skipBlanks(p + 1) != size)
+            fail(p + 1, "content after the root object");
+          return;
+        }
+      }
+      ++p;
+    }
+    fail(size, "unbalanced brackets");
+  }
+
+  size_t endOf(size_t begin) const
+  {
+    Span const key = { begin, 0 };
+    std::vector<Span>::const_iterator it = std::lower_bound(index.begin(), index.end(), key);
+    if (it == index.end() || it->begin != begin)
+      fail(begin, "no bracket indexed here");
+    return it->end;
+  }
+
+  // position after the scalar starting at p
+  size_t skipScalar(size_t p) const
+  {
+    if (base[p] == '"')
+      return skipString(p);
+    size_t q = p;
+    while (q < size && !is_delimiter(base[q]))
+      ++q;
+    if (q == p)
+      fail(p, "value expected");
+    return q;
+  }
+
+  Json::Value parseToken(size_t b, size_t e) const
+  {
+    Json::Value v;
+    Json::Reader reader;
+    if (!reader.parse(base + b, base + e, v, false))
+      fail(b, "bad value");
+    return v;
+  }
+
+  std::string parseKey(size_t b, size_t e) const
+  {
+    if (!std::memchr(base + b, '\\', e - b))
+      return std::string(base + b + 1, base + e - 1);
+    return parseToken(b, e).asString();
+  }
+
+  // the same conversions as load_from_json; plain strings, small integers
+  // and booleans are taken without a json parser
+  void toRecord(size_t b, size_t e, PTree::Record & r) const
+  {
+    char const* t = base + b;
+    size_t const n = e - b;
+    if (t[0] == '"' && !std::memchr(t, '\\', n))
+    {
+      r.setValue(std::string(t + 1, n - 2));
+      return;
+    }
+    if (n == 4 && !std::memcmp(t, "true", 4))
+    {
+      r.set_as<int>(1);
+      return;
+    }
+    if (n == 5 && !std::memcmp(t, "false", 5))
+    {
+      r.set_as<int>(0);
+      return;
+    }
+    size_t const digits = n - (t[0] == '-' ? 1 : 0);
+    char const* d = t + (n - digits);
+    if (digits > 0 && digits <= 9 && (d[0] != '0' || (digits == 1 && t[0] != '-')))
+    {
+      size_t i = 0;
+      while (i < digits && d[i] >= '0' && d[i] <= '9')
+        ++i;
+      if (i == digits)
+      {
+        r.setValue(std::string(t, n));
+        return;
+      }
+    }
+
+    Json::Value const v = parseToken(b, e);
+    switch (v.type())
+    {
+    case Json::nullValue:
+      r.undefine();
+      break;
+    case Json::intValue:
+      r.set_as(v.asInt());
+      break;
+    case Json::uintValue:
+      r.set_as(v.asUInt());
+      break;
+    case Json::realValue:
+      r.set_as(v.asDouble());
+      break;
+    case Json::stringValue:
+      r.set_as(v.asString());
+      break;
+    case Json::booleanValue:
+      r.set_as<int>(v.asBool());
+      break;
+    default:
+      fail(b, "unknown value type");
+    }
+  }
+
+  // An array of scalars is one record with elements; any other array keeps
+  // the index-key layout and is loaded like an object.
+  bool toElements(size_t begin, PTree::Record & r) const
+  {
+    PTree::Record::elements_t elements;
+    size_t p = skipBlanks(begin + 1);
+    while (base[p] != ']')
+    {
+      if (base[p] == '{' || base[p] == '[')
+        return false;
+      size_t const e = skipScalar(p);
+      PTree::Record element;
+      toRecord(p, e, element);
+      if (!element.isDefined())
+        return false;
+      elements.push_back(element.getValue());
+      p = skipBlanks(e);
+      if (base[p] == ',')
+        p = skipBlanks(p + 1);
+      else if (base[p] != ']')
+        fail(p, "',' or ']' expected");
+    }
+    r.setElementsConverted(elements);
+    return true;
+  }
+
+  // the value at p becomes a record or a container; returns the position
+  // after it
+  size_t addValue(std::string const& path, size_t p)
+  {
+    if (base[p] == '{' || base[p] == '[')
+    {
+      PTree::Record r;
+      if (base[p] == '[' && toElements(p, r))
+        records[path] = r;
+      else
+        containers.insert(std::make_pair(path, Container(p)));
+      return endOf(p) + 1;
+    }
+    size_t const e = skipScalar(p);
+    toRecord(p, e, records[path]);
+    return e;
+  }
+
+  // turns the members of a container into records and containers
+  void load(std::string const& path, Container & c)
+  {
+    if (c.loaded)
+      return;
+    char const close = base[c.begin] == '{' ? '}' : ']';
+    size_t p = skipBlanks(c.begin + 1);
+    for (size_t i = 0; base[p] != close; ++i)
+    {
+      std::string key;
+      if (close == ']')
+        key = boost::lexical_cast<std::string>(i);
+      else
+      {
+        if (base[p] != '"')
+          fail(p, "member name expected");
+        size_t const e = skipString(p);
+        key = parseKey(p, e);
+        p = skipBlanks(e);
+        if (base[p] != ':')
+          fail(p, "':' expected");
+        p = skipBlanks(p + 1);
+      }
+
+      p = skipBlanks(addValue(PTree::joinPaths(path, key), p));
+      if (base[p] == ',')
+        p = skipBlanks(p + 1);
+      else if (base[p] != close)
+        fail(p, "',' or closing bracket expected");
+    }
+    c.loaded = true;
+  }
+
+  bool isLoaded(std::string const& path) const
+  {
+    containers_t::const_iterator it = containers.find(path);
+    return it == containers.end() || it->second.loaded;
+  }
+
+  // whether loadParents(path) has nothing left to do
+  bool parentsLoaded(std::string const& path) const
+  {
+    if (!isLoaded(""))
+      return false;
+    for (size_t dot = path.find('.'); dot != std::string::npos; dot = path.find('.', dot + 1))
+      if (!isLoaded(path.substr(0, dot)))
+        return false;
+    return true;
+  }
+
+  // whether loadSubtree(prefix) has nothing left to do
+  bool subtreeLoaded(std::string const& prefix) const
+  {
+    if (!parentsLoaded(prefix) || !isLoaded(prefix))
+      return false;
+    std::string const children = prefix.empty() ? prefix : prefix + ".";
+    for (containers_t::const_iterator it = containers.lower_bound(children);
+         it != containers.end() && boost::starts_with(it->first, children);
+         ++it)
+      if (!it->second.loaded)
+        return false;
+    return true;
+  }
+
+  // Loads the containers above path.  Keys may contain dots, so every
+  // prefix ending before a dot is tried.
+  void loadParents(std::string const& path)
+  {
+    load("", containers.find("")->second);
+    for (size_t dot = path.find('.'); dot != std::string::npos; dot = path.find('.', dot + 1))
+    {
+      std::string const prefix = path.substr(0, dot);
+      containers_t::iterator it = containers.find(prefix);
+      if (it != containers.end())
+        load(prefix, it->second);
+    }
+  }
+
+  // children sort right after their parent, so one forward pass also loads
+  // the containers the pass itself adds
+  void loadSubtree(std::string const& prefix)
+  {
+    loadParents(prefix);
+    containers_t::iterator self = containers.find(prefix);
+    if (self != containers.end())
+      load(prefix, self->second);
+
+    std::string const children = prefix.empty() ? prefix : prefix + ".";
+    for (containers_t::iterator it = containers.lower_bound(children);
+         it != containers.end() && boost::starts_with(it->first, children);
+         ++it)
+      load(it->first, it->second);
+  }
+
+  bool findLoaded(std::string const& path, PTree::Record & r) const
+  {
+    records_t::const_iterator it = records.find(path);
+    if (it == records.end())
+      return false;
+    r = it->second;
+    return true;
+  }
+
+  void listLoaded(std::string const& prefix, std::vector<PTree::Source::entry_t> & result) const
+  {
+    std::string const children = prefix.empty() ? prefix : prefix + ".";
+    if (!prefix.empty())
+    {
+      records_t::const_iterator e = records.find(prefix);
+      if (e != records.end())
+        result.push_back(*e);
+    }
+    for (records_t::const_iterator it = records.lower_bound(children);
+         it != records.end() && boost::starts_with(it->first, children);
+         ++it)
+      result.push_back(*it);
+  }
+};
+
+
+JsonSource::JsonSource(std::string const& filename)
+{
+  try
+  {
+    impl.reset(new Impl(filename));
+  }
+  catch (boost::interprocess::interprocess_exception const& e)
+  {
+    throw std::runtime_error("Failed to map json file " + filename + ": " + e.what());
+  }
+}
+
+JsonSource::~JsonSource()
+{
+}
+
+size_t JsonSource::getLoadedCount() const
+{
+  boost::shared_lock<boost::shared_mutex> lock(impl->mutex);
+  return impl->records.size();
+}
+
+bool JsonSource::find(std::string const& path, PTree::Record & r) const
+{
+  boost::shared_lock<boost::shared_mutex> shared(impl->mutex);
+  if (!impl->parentsLoaded(path))
+  {
+    shared.unlock();
+    boost::unique_lock<boost::shared_mutex> exclusive(impl->mutex);
+    impl->loadParents(path);
+    return impl->findLoaded(path, r);
+  }
+  return impl->findLoaded(path, r);
+}
+
+void JsonSource::listRecords(std::string const& prefix,
+                             std::vector<PTree::Source::entry_t> & result) const
+{
+  boost::shared_lock<boost::shared_mutex> shared(impl->mutex);
+  if (!impl->subtreeLoaded(prefix))
+  {
+    shared.unlock();
+    boost::unique_lock<boost::shared_mutex> exclusive(impl->mutex);
+    impl->loadSubtree(prefix);
+    impl->listLoaded(prefix, result);
+    return;
+  }
+  impl->listLoaded(prefix, result);
+}
+
+}
@@ -0,0 +1,324 @@
+#define MXPROPS_EXPORTS
+#include "../shared.h"
+#include "snapshot_format.h"
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+
+namespace mxprops {
+
+namespace {
+
+namespace bip = boost::interprocess;
+
+char const SEGMENT_MAGIC[8] = { 'M', 'X', 'P', 'S', 'H', 'M', 'E', '1' };
+
+// The counters live in memory shared between processes, which only works
+// for atomics that are not implemented with a lock of this process.
+BOOST_STATIC_ASSERT(BOOST_ATOMIC_INT64_LOCK_FREE == 2);
+BOOST_STATIC_ASSERT(sizeof(boost::atomic<boost::uint64_t>) == sizeof(boost::uint64_t));
+
+// a reader lapped this often by the writer stops yielding and sleeps
+// between attempts, so that the writer gets the processor
+int const MAX_YIELD_ATTEMPTS = 1000;
+
+struct SegmentHeader
+{
+  char magic[8];
+  boost::uint32_t byteOrder;
+  boost::uint32_t reserved;
+  boost::uint64_t capacity;                    // bytes per image
+  boost::atomic<boost::uint64_t> version;      // publishes so far; image version % 2 is current
+  boost::atomic<boost::uint64_t> sequence[2];  // odd while that image is being written
+  boost::atomic<boost::uint64_t> imageSize[2];
+};
+
+size_t const IMAGES_OFFSET = (sizeof(SegmentHeader) + 63) / 64 * 64;
+
+char const* removed(std::string const& name)
+{
+  bip::shared_memory_object::remove(name.c_str());
+  return name.c_str();
+}
+
+} // namespace
+
+
+struct SharedTreeWriter::Impl
+{
+  std::string name;
+  std::string description; // for messages
+  bip::shared_memory_object shm;
+  boost::scoped_ptr<bip::mapped_region> region;
+  SegmentHeader *header;
+  char *images;
+  boost::mutex mutex; // publishes of this process
+
+  Impl(std::string const& name, size_t capacity)
+  : name(name),
+    description("shared memory " + name),
+    shm(bip::create_only, removed(name), bip::read_write)
+  {
+    shm.truncate(static_cast<bip::offset_t>(IMAGES_OFFSET + 2 * capacity));
+    region.reset(new bip::mapped_region(shm, bip::read_write));
+    char *base = static_cast<char *>(region->get_address());
+    header = new (base) SegmentHeader();
+    std::memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+    header->byteOrder = snapshot_format::BYTE_ORDER_MARK;
+    header->reserved = 0;
+    header->capacity = capacity;
+    header->version.store(0);
+    for (int b = 0; b < 2; ++b)
+    {
+      header->sequence[b].store(0);
+      header->imageSize[b].store(0);
+    }
+    images = base + IMAGES_OFFSET;
+  }
+};
+
+SharedTreeWriter::SharedTreeWriter(std::string const& name, size_t capacity)
+{
+  try
+  {
+    impl.reset(new Impl(name, capacity));
+  }
+  catch (bip::interprocess_exception const& e)
+  {
+    throw std::runtime_error("Failed to create shared memory " + name + ": " + e.what());
+  }
+}
+
+SharedTreeWriter::~SharedTreeWriter()
+{
+  bip::shared_memory_object::remove(impl->name.c_str());
+}
+
+bool SharedTreeWriter::publish(PTree::ConstRef const& src, std::vector<std::string> & messages)
+{
+  std::vector<char> image;
+  if (!snapshot_format::build_image(src, image, messages, impl->description))
+    return false;
+  if (image.size() > impl->header->capacity)
+  {
+    messages.push_back("Shared memory " + impl->name + " is too small: "
+                       + boost::lexical_cast<std::string>(image.size()) + " bytes needed");
+    return false;
+  }
+
+  boost::lock_guard<boost::mutex> g(impl->mutex);
+  SegmentHeader & h = *impl->header;
+  boost::uint64_t const v = h.version.load(boost::memory_order_relaxed);
+  size_t const b = (v + 1) % 2;
+  h.sequence[b].fetch_add(1, boost::memory_order_relaxed);
+  boost::atomic_thread_fence(boost::memory_order_release);
+  std::memcpy(impl->images + b * h.capacity, &image[0], image.size());
+  h.imageSize[b].store(image.size(), boost::memory_order_relaxed);
+  h.sequence[b].fetch_add(1, boost::memory_order_release);
+  h.version.store(v + 1, boost::memory_order_release);
+  return true;
+}
+
+boost::uint64_t SharedTreeWriter::getVersion() const
+{
+  return impl->header->version.load(boost::memory_order_acquire);
+}
+
+
+struct SharedTree::Impl
+{
+  std::string name;
+  std::string description; // for messages
+  bip::shared_memory_object shm;
+  bip::mapped_region region;
+  SegmentHeader const* header;
+  char const* images;
+
+  Impl(std::string const& name)
+  : name(name),
+    description("shared memory " + name),
+    shm(bip::open_only, name.c_str(), bip::read_only),
+    region(shm, bip::read_only)
+  {
+    char const* base = static_cast<char const*>(region.get_address());
+    header = reinterpret_cast<SegmentHeader const*>(base);
+    if (region.get_size() < IMAGES_OFFSET
+        || std::memcmp(header->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0
+        || header->byteOrder != snapshot_format::BYTE_ORDER_MARK
+        || region.get_size() < IMAGES_OFFSET + 2 * header->capacity)
+      throw std::runtime_error("Not a shared tree segment: " + name);
+    images = base + IMAGES_OFFSET;
+  }
+
+  // Runs op on the current image until it completes without the writer
+  // touching that image; nothing is read before the first publish.  A
+  // failed attempt yields to let the writer finish, and after
+  // MAX_YIELD_ATTEMPTS the reader sleeps a millisecond between attempts:
+  // it waits out a busy writer rather than failing.
+  template <typename TOp>
+  void read(TOp & op) const
+  {
+    for (int attempt = 0; ; ++attempt)
+    {
+      if (attempt >= MAX_YIELD_ATTEMPTS)
+        boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+      else if (attempt)
+        boost::this_thread::yield();
+
+      boost::uint64_t const v = header->version.load(boost::memory_order_acquire);
+      if (v == 0)
+        return;
+      size_t const b = v % 2;
+      boost::uint64_t const seq = header->sequence[b].load(boost::memory_order_acquire);
+      if (seq % 2)
+        continue; // lapped by two publishes, the current image has moved on
+
+      bool corrupted = false;
+      try
+      {
+        size_t const size = static_cast<size_t>(header->imageSize[b].load(boost::memory_order_relaxed));
+        snapshot_format::View view;
+        view.open(images + b * header->capacity, std::min<size_t>(size, header->capacity),
+                  description);
+        op(view);
+      }
+      catch (std::runtime_error const&)
+      {
+        corrupted = true; // possibly a torn read, decided below
+      }
+
+      boost::atomic_thread_fence(boost::memory_order_acquire);
+      if (header->sequence[b].load(boost::memory_order_relaxed) == seq)
+      {
+        if (corrupted)
+          throw std::runtime_error("Corrupted " + description);
+        return;
+      }
+      op.reset();
+    }
+  }
+};
+
+namespace {
+
+struct FindOp
+{
+  std::string const& path;
+  PTree::Record record;
+  bool found;
+
+  FindOp(std::string const& path)
+  : path(path), found(false)
+  { }
+
+  void operator () (snapshot_format::View const& view)
+  {
+    snapshot_format::Entry const* e = view.find(path);
+    if (e)
+    {
+      view.toRecord(*e, record);
+      found = true;
+    }
+  }
+
+  void reset()
+  {
+    record = PTree::Record();
+    found = false;
+  }
+};
+
+struct ListOp
+{
+  std::string const& prefix;
+  std::vector<PTree::Source::entry_t> records;
+
+  ListOp(std::string const& prefix)
+  : prefix(prefix)
+  { }
+
+  void operator () (snapshot_format::View const& view)
+  {
+    view.listRecords(prefix, records);
+  }
+
+  void reset()
+  {
+    records.clear();
+  }
+};
+
+struct SizeOp
+{
+  size_t size;
+
+  SizeOp()
+  : size(0)
+  { }
+
+  void operator () (snapshot_format::View const& view)
+  {
+    size = view.size();
+  }
+
+  void reset()
+  {
+    size = 0;
+  }
+};
+
+} // namespace
+
+SharedTree::SharedTree(std::string const& name)
+{
+  try
+  {
+    impl.reset(new Impl(name));
+  }
+  catch (bip::interprocess_exception const& e)
+  {
+    throw std::runtime_error("Failed to open shared memory " + name + ": " + e.what());
+  }
+}
+
+SharedTree::~SharedTree()
+{
+}
+
+size_t SharedTree::size() const
+{
+  SizeOp op;
+  impl->read(op);
+  return op.size;
+}
+
+bool SharedTree::find(std::string const& path, PTree::Record & r) const
+{
+  FindOp op(path);
+  impl->read(op);
+  if (op.found)
+    r = op.record;
+  return op.found;
+}
+
+void SharedTree::listRecords(std::string const& prefix,
+                             std::vector<PTree::Source::entry_t> & result) const
+{
+  ListOp op(prefix);
+  impl->read(op);
+  result.insert(result.end(), op.records.begin(), op.records.end());
+}
+
+boost::uint64_t SharedTree::getVersion() const
+{
+  return impl->header->version.load(boost::memory_order_acquire);
+}
+
+}
@@ -0,0 +1,490 @@
+#define MXPROPS_EXPORTS
+#include "snapshot_format.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+
+namespace mxprops {
+
+namespace snapshot_format {
+
+char const MAGIC[8] = { 'M', 'X', 'P', 'S', 'N', 'A', 'P', '2' };
+
+// JSON number grammar
+bool parse_number(std::string const& s, bool & isInteger)
+{
+  size_t i = 0;
+  if (i < s.size() && s[i] == '-')
+    ++i;
+  size_t const intStart = i;
+  while (i < s.size() && isdigit(static_cast<unsigned char>(s[i])))
+    ++i;
+  if (i == intStart || (s[intStart] == '0' && i - intStart > 1))
+    return false;
+  isInteger = i == s.size();
+  if (i < s.size() && s[i] == '.')
+  {
+    size_t const fracStart = ++i;
+    while (i < s.size() && isdigit(static_cast<unsigned char>(s[i])))
+      ++i;
+    if (i == fracStart)
+      return false;
+  }
+  if (i < s.size() && (s[i] == 'e' || s[i] == 'E'))
+  {
+    ++i;
+    if (i < s.size() && (s[i] == '+' || s[i] == '-'))
+      ++i;
+    size_t const expStart = i;
+    while (i < s.size() && isdigit(static_cast<unsigned char>(s[i])))
+      ++i;
+    if (i == expStart)
+      return false;
+  }
+  return i == s.size();
+}
+
+}
+
+using namespace snapshot_format;
+
+namespace {
+
+// Numbers are stored as payloads only if formatting the payload gives the
+// string back, so "007" or "1.50" stay strings; values with path data too.
+Snapshot::ValueType detect_type(PTree::Record const& r, boost::int64_t & integer, double & real)
+{
+  if (r.isArray())
+    return Snapshot::ArrayValue;
+  std::string const& v = r.getValue();
+  bool isInteger = false;
+  if (r.hasPathData() || !parse_number(v, isInteger))
+    return Snapshot::StringValue;
+  if (isInteger)
+  {
+    boost::optional<boost::int64_t> const i = Converter<boost::int64_t>::parse(v);
+    if (!i || *Converter<boost::int64_t>::format(*i) != v)
+      return Snapshot::StringValue;
+    integer = *i;
+    return Snapshot::IntegerValue;
+  }
+  boost::optional<double> const d = Converter<double>::parse(v);
+  if (!d || *Converter<double>::format(*d) != v)
+    return Snapshot::StringValue;
+  real = *d;
+  return Snapshot::RealValue;
+}
+
+// Offsets and lengths are 32-bit; anything that would not fit sets
+// overflow instead of being cut short.
+class PoolWriter
+{
+public:
+  PoolWriter()
+  : overflow(false)
+  { }
+
+  Slice add(char const* p, size_t n)
+  {
+    Slice r;
+    r.offset = 0;
+    r.length = 0;
+    if (n > 0xffffffffu - pool.size() || pool.size() > 0xffffffffu)
+    {
+      overflow = true;
+      return r;
+    }
+    r.offset = static_cast<boost::uint32_t>(pool.size());
+    r.length = static_cast<boost::uint32_t>(n);
+    pool.insert(pool.end(), p, p + n);
+    return r;
+  }
+
+  Slice add(std::string const& s)
+  {
+    return add(s.data(), s.size());
+  }
+
+  template <typename TNumber>
+  Slice addNumber(TNumber v)
+  {
+    return add(reinterpret_cast<char const*>(&v), sizeof(v));
+  }
+
+  Slice addElements(PTree::Record::elements_t const& elements)
+  {
+    std::vector<Slice> table(elements.size());
+    for (size_t i = 0; i < elements.size(); ++i)
+      table[i] = add(elements[i]);
+
+    while (pool.size() % sizeof(boost::uint32_t) != 0)
+      pool.push_back('\0');
+    Slice r = add(table.empty() ? 0 : reinterpret_cast<char const*>(&table[0]),
+                  table.size() * sizeof(Slice));
+    r.length = static_cast<boost::uint32_t>(elements.size());
+    return r;
+  }
+
+  std::vector<char> pool;
+  bool overflow;
+};
+
+} // namespace
+
+
+namespace snapshot_format {
+
+View::View()
+: header(0), entries(0), pathData(0), pool(0)
+{
+}
+
+void View::open(char const* base, size_t size, std::string const& name)
+{
+  if (size < sizeof(Header))
+    throw std::runtime_error("Truncated snapshot " + name);
+  header = reinterpret_cast<Header const*>(base);
+  if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+      || header->byteOrder != BYTE_ORDER_MARK)
+    throw std::runtime_error("Not a snapshot or wrong byte order: " + name);
+
+  size_t const entriesSize = size_t(header->recordCount) * sizeof(Entry);
+  size_t const pathDataSize = size_t(header->pathDataCount) * sizeof(PathDataEntry);
+  if (size != sizeof(Header) + entriesSize + pathDataSize + header->poolSize)
+    throw std::runtime_error("Bad snapshot size: " + name);
+
+  entries = reinterpret_cast<Entry const*>(base + sizeof(Header));
+  pathData = reinterpret_cast<PathDataEntry const*>(base + sizeof(Header) + entriesSize);
+  pool = base + sizeof(Header) + entriesSize + pathDataSize;
+}
+
+void View::check(Slice const& s, size_t itemSize) const
+{
+  if (s.offset > header->poolSize
+      || (header->poolSize - s.offset) / itemSize < s.length)
+    throw std::runtime_error("Corrupted snapshot");
+}
+
+std::string View::str(Slice const& s) const
+{
+  check(s);
+  return std::string(pool + s.offset, s.length);
+}
+
+int View::compare(Entry const& e, char const* key, size_t keyLength) const
+{
+  check(e.key);
+  int const c = std::memcmp(pool + e.key.offset, key, std::min<size_t>(e.key.length, keyLength));
+  if (c != 0)
+    return c;
+  return e.key.length < keyLength ? -1 : (e.key.length > keyLength ? 1 : 0);
+}
+
+Entry const* View::lowerBound(std::string const& key) const
+{
+  Entry const* first = entries;
+  size_t count = header->recordCount;
+  while (count > 0)
+  {
+    size_t const half = count / 2;
+    if (compare(first[half], key.data(), key.size()) < 0)
+    {
+      first += half + 1;
+      count -= half + 1;
+    }
+    else
+      count = half;
+  }
+  return first;
+}
+
+Entry const* View::find(std::string const& key) const
+{
+  Entry const* e = lowerBound(key);
+  if (e == end() || compare(*e, key.data(), key.size()) != 0)
+    return 0;
+  return e;
+}
+
+Snapshot::ValueType View::getType(std::string const& key) const
+{
+  Entry const* e = find(key);
+  return e ? Snapshot::ValueType(e->type) : Snapshot::StringValue;
+}
+
+bool View::hasPrefix(Entry const& e, std::string const& prefix) const
+{
+  check(e.key);
+  return e.key.length >= prefix.size()
+      && std::memcmp(pool + e.key.offset, prefix.data(), prefix.size()) == 0;
+}
+
+void View::toRecord(Entry const& e, PTree::Record & r) const
+{
+  if (e.type == Snapshot::IntegerValue || e.type == Snapshot::RealValue)
+  {
+    if (e.value.length != 8)
+      throw std::runtime_error("Corrupted snapshot");
+    check(e.value);
+    if (e.type == Snapshot::IntegerValue)
+    {
+      boost::int64_t v;
+      std::memcpy(&v, pool + e.value.offset, sizeof(v));
+      r.setInteger(v);
+    }
+    else
+    {
+      double v;
+      std::memcpy(&v, pool + e.value.offset, sizeof(v));
+      r.setReal(v);
+    }
+  }
+  else if (e.type == Snapshot::ArrayValue)
+  {
+    check(e.value, sizeof(Slice));
+    Slice const* table = reinterpret_cast<Slice const*>(pool + e.value.offset);
+    PTree::Record::elements_t elements(e.value.length);
+    for (size_t i = 0; i < elements.size(); ++i)
+      elements[i] = str(table[i]);
+    r.setElements(elements);
+  }
+  else if (e.pathData != NO_PATH_DATA)
+  {
+    if (e.pathData >= header->pathDataCount)
+      throw std::runtime_error("Corrupted snapshot");
+    PathDataEntry const& pde = pathData[e.pathData];
+    PathPropData pd;
+    pd.isPathType = (pde.flags & PATH_TYPE) != 0;
+    pd.isRelative = (pde.flags & RELATIVE) != 0;
+    pd.originalPath = str(pde.originalPath);
+    pd.originalFilePath = str(pde.originalFilePath);
+    r.setValue(str(e.value), pd);
+  }
+  else
+    r.setValue(str(e.value));
+}
+
+void View::listRecords(std::string const& prefix,
+                       std::vector<PTree::Source::entry_t> & result) const
+{
+  std::string const children = prefix.empty() ? prefix : prefix + ".";
+  if (!prefix.empty())
+  {
+    Entry const* e = find(prefix);
+    if (e)
+    {
+      result.push_back(PTree::Source::entry_t(prefix, PTree::Record()));
+      toRecord(*e, result.back().second);
+    }
+  }
+  for (Entry const* e = lowerBound(children);
+       e != end() && hasPrefix(*e, children);
+       ++e)
+  {
+    result.push_back(PTree::Source::entry_t(str(e->key), PTree::Record()));
+    toRecord(*e, result.back().second);
+  }
+}
+
+bool build_image(PTree::ConstRef const& src,
+                 std::vector<char> & image,
+                 std::vector<std::string> & messages,
+                 std::string const& name)
+{
+  std::vector<PTree::Source::entry_t> records;
+  src.listRecordsRecursive(records);
+  if (records.size() > 0xffffffffu)
+  {
+    messages.push_back("Snapshot has too many records: " + name);
+    return false;
+  }
+
+  PoolWriter pool;
+  std::vector<Entry> entries(records.size());
+  std::vector<PathDataEntry> pathData;
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    PTree::Record const& r = records[i].second;
+    Entry & e = entries[i];
+    std::memset(&e, 0, sizeof(e));
+    e.key = pool.add(records[i].first);
+    boost::int64_t integer = 0;
+    double real = 0;
+    Snapshot::ValueType const type = detect_type(r, integer, real);
+    e.type = static_cast<boost::uint8_t>(type);
+    switch (type)
+    {
+    case Snapshot::IntegerValue:
+      e.value = pool.addNumber(integer);
+      break;
+    case Snapshot::RealValue:
+      e.value = pool.addNumber(real);
+      break;
+    case Snapshot::ArrayValue:
+      e.value = pool.addElements(r.getElements());
+      break;
+    default:
+      e.value = pool.add(r.getValue());
+    }
+    e.pathData = NO_PATH_DATA;
+
+    if (r.hasPathData())
+    {
+      PathPropData const& pd = r.getPathData();
+      PathDataEntry pde;
+      pde.flags = (pd.isPathType ? PATH_TYPE : 0) | (pd.isRelative ? RELATIVE : 0);
+      pde.originalPath = pool.add(pd.originalPath);
+      pde.originalFilePath = pool.add(pd.originalFilePath);
+      e.pathData = static_cast<boost::uint32_t>(pathData.size());
+      pathData.push_back(pde);
+    }
+  }
+
+  if (pool.overflow)
+  {
+    messages.push_back("Snapshot pool exceeds 4GB: " + name);
+    return false;
+  }
+
+  Header h;
+  std::memcpy(h.magic, MAGIC, sizeof(h.magic));
+  h.byteOrder = BYTE_ORDER_MARK;
+  h.recordCount = static_cast<boost::uint32_t>(entries.size());
+  h.pathDataCount = static_cast<boost::uint32_t>(pathData.size());
+  h.poolSize = static_cast<boost::uint32_t>(pool.pool.size());
+
+  image.clear();
+  image.reserve(sizeof(h) + entries.size() * sizeof(Entry)
+                + pathData.size() * sizeof(PathDataEntry) + pool.pool.size());
+  char const* p = reinterpret_cast<char const*>(&h);
+  image.insert(image.end(), p, p + sizeof(h));
+  if (!entries.empty())
+  {
+    p = reinterpret_cast<char const*>(&entries[0]);
+    image.insert(image.end(), p, p + entries.size() * sizeof(Entry));
+  }
+  if (!pathData.empty())
+  {
+    p = reinterpret_cast<char const*>(&pathData[0]);
+    image.insert(image.end(), p, p + pathData.size() * sizeof(PathDataEntry));
+  }
+  image.insert(image.end(), pool.pool.begin(), pool.pool.end());
+  return true;
+}
+
+} // namespace snapshot_format
+
+
+struct Snapshot::Impl
+{
+  boost::interprocess::file_mapping file;
+  boost::interprocess::mapped_region region;
+  View view;
+
+  Impl(std::string const& filename)
+  : file(filename.c_str(), boost::interprocess::read_only),
+    region(file, boost::interprocess::read_only)
+  {
+    view.open(static_cast<char const*>(region.get_address()), region.get_size(),
+              "file " + filename);
+  }
+};
+
+
+Snapshot::Snapshot(std::string const& filename)
+{
+  try
+  {
+    impl.reset(new Impl(filename));
+  }
+  catch (boost::interprocess::interprocess_exception const& e)
+  {
+    throw std::runtime_error("Failed to map snapshot file " + filename + ": " + e.what());
+  }
+}
+
+Snapshot::~Snapshot()
+{
+}
+
+size_t Snapshot::size() const
+{
+  return impl->view.size();
+}
+
+Snapshot::ValueType Snapshot::getType(std::string const& path) const
+{
+  return impl->view.getType(path);
+}
+
+bool Snapshot::find(std::string const& path, PTree::Record & r) const
+{
+  Entry const* e = impl->view.find(path);
+  if (!e)
+    return false;
+  impl->view.toRecord(*e, r);
+  return true;
+}
+
+void Snapshot::listRecords(std::string const& prefix,
+                           std::vector<PTree::Source::entry_t> & result) const
+{
+  impl->view.listRecords(prefix, result);
+}
+
+
+bool save_snapshot(mxprops::PTree::ConstRef const& src,
+                   std::vector<std::string> & messages,
+                   std::string const& filename)
+{
+  std::vector<char> image;
+  if (!build_image(src, image, messages, filename))
+    return false;
+
+  std::ofstream f(filename.c_str(), std::ios::binary | std::ios::trunc);
+  f.write(&image[0], image.size());
+  if (!f)
+  {
+    messages.push_back("Failed to write snapshot file " + filename);
+    return false;
+  }
+  return true;
+}
+
+bool load_snapshot(mxprops::PTree::Ref const& dst,
+                   std::vector<std::string> & messages,
+                   std::string const& filename)
+{
+  try
+  {
+    Snapshot const snapshot(filename);
+    std::vector<PTree::Source::entry_t> records;
+    snapshot.listRecords("", records);
+    PTree::Batch batch;
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+      // converted once here rather than on every getArray of the tree
+      PTree::Record & r = records[i].second;
+      if (r.isArray())
+      {
+        PTree::Record::elements_t const elements = r.getElements();
+        r.setElementsConverted(elements);
+      }
+      batch.setRecord(records[i].first, r);
+    }
+    dst.apply(batch);
+    return true;
+  }
+  catch (std::runtime_error const& e)
+  {
+    messages.push_back(e.what());
+    return false;
+  }
+}
+
+}
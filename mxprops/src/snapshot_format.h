@@ -0,0 +1,130 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+#include "../snapshot.h"
+#include <boost/cstdint.hpp>
+
+
+// Layout of snapshot images, shared by the snapshot files and the shared
+// memory trees; not a public header.
+
+namespace mxprops {
+namespace snapshot_format {
+
+extern char const MAGIC[8];
+boost::uint32_t const BYTE_ORDER_MARK = 0x01020304;
+boost::uint32_t const NO_PATH_DATA = 0xffffffff;
+
+enum PathDataFlags
+{
+  PATH_TYPE = 1,
+  RELATIVE  = 2
+};
+
+struct Header
+{
+  char magic[8];
+  boost::uint32_t byteOrder;
+  boost::uint32_t recordCount;
+  boost::uint32_t pathDataCount;
+  boost::uint32_t poolSize;
+};
+
+struct Slice
+{
+  boost::uint32_t offset;
+  boost::uint32_t length;
+};
+
+// Integers and reals are kept in the pool as 8-byte payloads, an int64 or
+// an IEEE double in the byte order of the writer, unaligned; only numbers
+// whose string reads back the same are, the others stay strings.
+struct Entry
+{
+  Slice key;
+  Slice value;              // for arrays: offset of a Slice table and element count
+  boost::uint32_t pathData; // index in the path data table or NO_PATH_DATA
+  boost::uint8_t type;
+  boost::uint8_t reserved[3];
+};
+
+struct PathDataEntry
+{
+  boost::uint32_t flags;
+  Slice originalPath;
+  Slice originalFilePath;
+};
+
+// whether s is a number by the JSON grammar, and an integer at that
+bool parse_number(std::string const& s, bool & isInteger);
+
+// The defined records of src, keys relative to src, as a snapshot image;
+// false if it does not fit the 32-bit offsets.
+bool build_image(PTree::ConstRef const& src,
+                 std::vector<char> & image,
+                 std::vector<std::string> & messages,
+                 std::string const& name);
+
+// Read access to an image in memory.  Offsets are checked on access rather
+// than on open, so that opening does not touch every page; a malformed
+// image throws std::runtime_error.
+class View
+{
+public:
+  View();
+
+  void open(char const* base, size_t size, std::string const& name);
+
+  size_t size() const { return header->recordCount; }
+
+  Entry const* find(std::string const& key) const;
+  Snapshot::ValueType getType(std::string const& key) const;
+  void toRecord(Entry const& e, PTree::Record & r) const;
+  void listRecords(std::string const& prefix,
+                   std::vector<PTree::Source::entry_t> & result) const;
+
+private:
+  void check(Slice const& s, size_t itemSize = 1) const;
+  std::string str(Slice const& s) const;
+  int compare(Entry const& e, char const* key, size_t keyLength) const;
+  Entry const* lowerBound(std::string const& key) const;
+  Entry const* end() const { return entries + header->recordCount; }
+  bool hasPrefix(Entry const& e, std::string const& prefix) const;
+
+  Header const* header;
+  Entry const* entries;
+  PathDataEntry const* pathData;
+  char const* pool;
+};
+
+} // namespace snapshot_format
+} // namespace mxprops
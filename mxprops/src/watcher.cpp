@@ -0,0 +1,330 @@
+#define MXPROPS_EXPORTS
+#include "../watcher.h"
+#include "../io.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <sstream>
+#ifdef __linux__
+# include <sys/inotify.h>
+# include <poll.h>
+# include <unistd.h>
+#endif
+
+
+namespace mxprops {
+
+namespace {
+
+typedef std::vector<PTree::Source::entry_t> records_t;
+typedef std::map<std::string, PTree::Record> merged_t;
+
+// Modification time and size of a file.  Nanoseconds where stat has them,
+// so that two writes within one second do not look the same; elsewhere
+// whole seconds, with the size catching most rewrites in between.
+struct FileStamp
+{
+  boost::int64_t seconds;
+  long nanoseconds;
+  boost::uint64_t size;
+
+  FileStamp()
+  : seconds(0), nanoseconds(0), size(0)
+  { }
+
+  bool operator != (FileStamp const& s) const
+  {
+    return seconds != s.seconds || nanoseconds != s.nanoseconds || size != s.size;
+  }
+
+  // false if the file cannot be stat'ed
+  bool read(std::string const& name)
+  {
+    struct stat st;
+    if (stat(name.c_str(), &st) != 0)
+      return false;
+#if defined(__APPLE__)
+    seconds = st.st_mtimespec.tv_sec;
+    nanoseconds = st.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+    seconds = st.st_mtim.tv_sec;
+    nanoseconds = st.st_mtim.tv_nsec;
+#else
+    seconds = st.st_mtime;
+    nanoseconds = 0;
+#endif
+    size = st.st_size;
+    return true;
+  }
+};
+
+struct WatchedSource
+{
+  bool isFile;
+  std::string name;     // file name, or the "-key=value" argument
+  std::string dir;
+  std::string base;
+  FileStamp stamp;
+  bool dirty;
+  records_t records;    // relative keys, undefined records included
+
+  WatchedSource(bool isFile, std::string const& name)
+  : isFile(isFile),
+    name(name),
+    dirty(false)
+  {
+    size_t const slash = name.rfind('/');
+    dir = slash == std::string::npos ? "." : name.substr(0, slash);
+    base = slash == std::string::npos ? name : name.substr(slash + 1);
+  }
+
+  bool modified() const
+  {
+    FileStamp now;
+    if (!now.read(name))
+      return false; // being replaced; wait for the new file to appear
+    return dirty || now != stamp;
+  }
+
+  bool parse(std::vector<std::string> & messages)
+  {
+    PTree staging;
+    if (isFile)
+    {
+      stamp.read(name);
+      if (!load_from_json_file(staging.root(""), messages, name))
+        return false;
+    }
+    else
+    {
+      char const* args[] = { "", name.c_str() };
+      if (!load_from_command_line(staging.root(""), messages, 2, args))
+        return false;
+    }
+    records.clear();
+    staging.root("").listRecordsRecursive(records, true);
+    dirty = false;
+    return true;
+  }
+};
+
+bool same_value(PTree::Record const& a, PTree::Record const& b)
+{
+  return a.isDefined() == b.isDefined() && a.getValue() == b.getValue()
+      && a.isArray() == b.isArray() && a.getElements() == b.getElements();
+}
+
+} // namespace
+
+
+struct ConfigWatcher::Impl
+{
+  PTree::Ref dst;
+  std::vector<WatchedSource> sources;
+  merged_t merged;
+  boost::atomic<bool> stopping;
+
+  boost::mutex reloadMutex; // one reload at a time, including its apply
+  mutable boost::mutex mutex; // reload() may run on the caller's thread too
+  size_t reloadCount;
+  std::vector<std::string> lastMessages;
+
+  Impl(PTree::Ref const& dst)
+  : dst(dst),
+    stopping(false),
+    reloadCount(0)
+  { }
+
+  void add(WatchedSource const& src)
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    sources.push_back(src);
+    std::vector<std::string> messages;
+    if (!sources.back().parse(messages))
+    {
+      sources.pop_back();
+      std::string text = "Cannot watch " + src.name;
+      for (size_t i = 0; i < messages.size(); ++i)
+        text += ": " + messages[i];
+      throw std::runtime_error(text);
+    }
+    merged = merge();
+  }
+
+  // later sources override earlier ones, as when they were loaded
+  merged_t merge() const
+  {
+    merged_t result;
+    for (size_t i = 0; i < sources.size(); ++i)
+      for (size_t k = 0; k < sources[i].records.size(); ++k)
+        result[sources[i].records[k].first] = sources[i].records[k].second;
+    return result;
+  }
+
+  // The batch is applied with only reloadMutex held, so listeners of dst may
+  // query the watcher.
+  bool reload(std::vector<std::string> & messages)
+  {
+    boost::lock_guard<boost::mutex> serial(reloadMutex);
+    PTree::Batch batch;
+    bool const ok = diff(messages, batch);
+    if (!batch.empty())
+      dst.apply(batch);
+    return ok;
+  }
+
+  bool diff(std::vector<std::string> & messages, PTree::Batch & batch)
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    bool ok = true;
+    bool changed = false;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+      WatchedSource & src = sources[i];
+      if (!src.isFile || !src.modified())
+        continue;
+      if (src.parse(messages))
+        changed = true;
+      else
+        ok = false;
+    }
+    if (!changed)
+      return ok;
+
+    merged_t const next = merge();
+    for (merged_t::const_iterator it = next.begin(); it != next.end(); ++it)
+    {
+      merged_t::const_iterator const prev = merged.find(it->first);
+      if (prev != merged.end() && same_value(prev->second, it->second))
+        continue;
+      if (it->second.isDefined())
+        batch.setRecord(it->first, it->second);
+      else
+        batch.undefine(it->first);
+    }
+    for (merged_t::const_iterator it = merged.begin(); it != merged.end(); ++it)
+      if (next.find(it->first) == next.end())
+        batch.undefine(it->first);
+
+    merged = next;
+    ++reloadCount;
+    return ok;
+  }
+};
+
+
+ConfigWatcher::ConfigWatcher(PTree::Ref const& dst)
+: impl(new Impl(dst))
+{
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+  stop();
+}
+
+void ConfigWatcher::addJsonFile(std::string const& filename)
+{
+  impl->add(WatchedSource(true, filename));
+}
+
+void ConfigWatcher::addCommandLine(int argc, char const* argv[])
+{
+  for (int i = 1; i < argc; ++i)
+    impl->add(WatchedSource(argv[i][0] != '-', argv[i]));
+}
+
+bool ConfigWatcher::reload(std::vector<std::string> & messages)
+{
+  return impl->reload(messages);
+}
+
+void ConfigWatcher::start()
+{
+  impl->stopping = false;
+  mxasync::Actor::start();
+}
+
+void ConfigWatcher::stop()
+{
+  impl->stopping = true;
+  join();
+}
+
+size_t ConfigWatcher::getReloadCount() const
+{
+  boost::lock_guard<boost::mutex> g(impl->mutex);
+  return impl->reloadCount;
+}
+
+std::vector<std::string> ConfigWatcher::getLastMessages() const
+{
+  boost::lock_guard<boost::mutex> g(impl->mutex);
+  return impl->lastMessages;
+}
+
+void ConfigWatcher::run()
+{
+#ifdef __linux__
+  int const fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (fd < 0)
+    return;
+
+  // directories are watched, so that files replaced by rename are seen too
+  std::map<int, std::string> dirs;
+  {
+    boost::lock_guard<boost::mutex> g(impl->mutex);
+    for (size_t i = 0; i < impl->sources.size(); ++i)
+    {
+      WatchedSource const& src = impl->sources[i];
+      if (!src.isFile)
+        continue;
+      int const wd = inotify_add_watch(fd, src.dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+      if (wd >= 0)
+        dirs[wd] = src.dir;
+    }
+  }
+
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (!impl->stopping)
+  {
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    if (poll(&p, 1, 200) <= 0)
+      continue;
+
+    bool any = false;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+      for (char *ptr = buf; ptr < buf + n; )
+      {
+        inotify_event const* e = reinterpret_cast<inotify_event const*>(ptr);
+        ptr += sizeof(inotify_event) + e->len;
+        if (e->len == 0 || dirs.find(e->wd) == dirs.end())
+          continue;
+
+        boost::lock_guard<boost::mutex> g(impl->mutex);
+        for (size_t i = 0; i < impl->sources.size(); ++i)
+        {
+          WatchedSource & src = impl->sources[i];
+          if (src.isFile && src.dir == dirs[e->wd] && src.base == e->name)
+            src.dirty = any = true;
+        }
+      }
+    }
+
+    if (any)
+    {
+      std::vector<std::string> messages;
+      impl->reload(messages);
+      boost::lock_guard<boost::mutex> g(impl->mutex);
+      impl->lastMessages.swap(messages);
+    }
+  }
+  close(fd);
+#endif
+}
+
+}
@@ -1,5 +1,20 @@
 #include "gtest/gtest.h"
 #include <mxprops/mxprops.h>
+#include <mxprops/io.h>
+#include <mxprops/snapshot.h>
+#include <mxprops/shared.h>
+#include <mxprops/json_source.h>
+#include <mxprops/binding.h>
+#include <mxprops/schema.h>
+#include <mxprops/notify.h>
+#include <mxprops/watcher.h>
+#include <boost/aligned_storage.hpp>
+#include <boost/thread/barrier.hpp>
+#include <fstream>
+#include <unistd.h>
+#include <sstream>
+#include <json-cpp/reader.h>
+#include <json-cpp/value.h>
 
 using namespace mxprops;
 
@@ -30,6 +45,1405 @@ TEST(MxPropsTest, ConstRoot)
   EXPECT_FALSE(root.getOptional<int>("a_value"));
 }
 
+TEST(MxPropsTest, ArrayValues)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+
+  std::vector<double> calib;
+  calib.push_back(0.5);
+  calib.push_back(1.5);
+  root.setArray("calib", calib);
+
+  EXPECT_EQ(calib, root.getArray<double>("calib"));
+  EXPECT_EQ(1.5, root.get<double>("calib.1"));
+  EXPECT_FALSE(root.getOptional<double>("calib.2"));
+  EXPECT_FALSE(root.getOptional<double>("calib"));
+  EXPECT_THROW(root.getArray<int>("missing"), PropsError);
+
+  // the vector written is shared, not parsed again; other types still parse
+  boost::shared_ptr<std::vector<double> const> const view = root.getArrayPtr<double>("calib");
+  ASSERT_TRUE(view);
+  EXPECT_EQ(view.get(), root.getArrayPtr<double>("calib").get());
+  EXPECT_EQ(calib, *view);
+  EXPECT_FALSE(root.getArrayPtr<int>("calib"));
+  EXPECT_FALSE(root.getArrayPtr<double>("missing"));
+}
+
+TEST(MxPropsTest, JsonArrays)
+{
+  Json::Value doc;
+  ASSERT_TRUE(Json::Reader().parse(
+      "{\"a\": [1, 2, 3], \"objs\": [{\"x\": 7}], \"b\": 4}", doc));
+
+  PTree tree;
+  std::vector<std::string> messages;
+  ASSERT_TRUE(load_from_json(tree.root("my_root"), messages, doc));
+
+  PTree::ConstRef root = tree.root("my_root");
+  std::vector<int> const a = root.getArray<int>("a");
+  ASSERT_EQ(3u, a.size());
+  EXPECT_EQ(3, a[2]);
+  EXPECT_EQ(2, root.get<int>("a.1"));
+  EXPECT_EQ(7, root.get<int>("objs.0.x"));
+  EXPECT_EQ(4, root.get<int>("b"));
+
+  // converted when loaded, so reads share the vectors instead of parsing
+  boost::shared_ptr<std::vector<int> const> const ints = root.getArrayPtr<int>("a");
+  ASSERT_TRUE(ints);
+  EXPECT_EQ(ints.get(), root.getArrayPtr<int>("a").get());
+  boost::shared_ptr<std::vector<double> const> const doubles = root.getArrayPtr<double>("a");
+  ASSERT_TRUE(doubles);
+  EXPECT_EQ(doubles.get(), root.getArrayPtr<double>("a").get());
+  EXPECT_EQ(3.0, (*doubles)[2]);
+
+  ASSERT_TRUE(Json::Reader().parse("{\"r\": [1, 2.5], \"s\": [\"x\", \"y\"]}", doc));
+  ASSERT_TRUE(load_from_json(tree.root(""), messages, doc));
+  EXPECT_FALSE(tree.root("").getArrayPtr<int>("r"));
+  boost::shared_ptr<std::vector<double> const> const reals = tree.root("").getArrayPtr<double>("r");
+  ASSERT_TRUE(reals);
+  EXPECT_EQ(reals.get(), tree.root("").getArrayPtr<double>("r").get());
+  boost::shared_ptr<std::vector<std::string> const> const strings = tree.root("").getArrayPtr<std::string>("s");
+  ASSERT_TRUE(strings);
+  EXPECT_EQ(strings.get(), tree.root("").getArrayPtr<std::string>("s").get());
+}
+
+TEST(MxPropsTest, Snapshot)
+{
+  std::string const filename = "mxprops_test_snapshot.bin";
+  std::vector<std::string> messages;
+  {
+    PTree tree;
+    PTree::Ref root = tree.root("my_root");
+    root.set("cam.threshold", 0.25);
+    root.set("cam.name", std::string("front"));
+    root.set("cam-x", 1);
+    root.setArray("cam.roi", std::vector<int>(4, 8));
+    root.set("cam.big", INT64_C(-9000000000));
+    root.set("cam.code", "007");
+    ASSERT_TRUE(save_snapshot(root.getSubtree("cam"), messages, filename));
+  }
+
+  PSnapshot snapshot(new Snapshot(filename));
+  EXPECT_EQ(5u, snapshot->size());
+  EXPECT_EQ(Snapshot::RealValue, snapshot->getType("threshold"));
+  EXPECT_EQ(Snapshot::IntegerValue, snapshot->getType("big"));
+  EXPECT_EQ(Snapshot::StringValue, snapshot->getType("code"));
+
+  // numbers come back with the same string, and typed
+  PTree::Record r;
+  ASSERT_TRUE(snapshot->find("big", r));
+  EXPECT_EQ("-9000000000", r.getValue());
+  EXPECT_EQ(INT64_C(-9000000000), r.get_as<boost::int64_t>());
+  EXPECT_EQ(-9e9, r.get_as<double>());
+  EXPECT_FALSE(r.get_as<int>());
+  ASSERT_TRUE(snapshot->find("code", r));
+  EXPECT_EQ("007", r.getValue());
+
+  PTree tree;
+  tree.attach(snapshot);
+  PTree::Ref root = tree.root("my_root");
+  EXPECT_EQ(0.25, root.get<double>("threshold"));
+  EXPECT_EQ(8, root.get<int>("roi.3"));
+  root.set("threshold", 0.5);
+  EXPECT_EQ(0.5, root.get<double>("threshold"));
+
+  std::vector<std::string> keys;
+  root.listKeysRecursive(keys);
+  ASSERT_EQ(5u, keys.size());
+  EXPECT_EQ("big", keys[0]);
+
+  PTree copy;
+  ASSERT_TRUE(load_snapshot(copy.root("my_root").getSubtree("cam"), messages, filename));
+  EXPECT_EQ("front", copy.root("my_root").get<std::string>("cam.name"));
+  EXPECT_EQ(1u, copy.getVersion()); // one write for the whole snapshot
+  boost::shared_ptr<std::vector<int> const> const roi = copy.root("").getArrayPtr<int>("cam.roi");
+  ASSERT_TRUE(roi);
+  EXPECT_EQ(roi.get(), copy.root("").getArrayPtr<int>("cam.roi").get());
+  std::remove(filename.c_str());
+}
+
+TEST(MxPropsTest, Freeze)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("a.b", 1);
+  root.set("a.c", 2);
+  root.undefine("a.d");
+  root.setArray("arr", std::vector<int>(2, 5));
+  tree.freeze();
+
+  EXPECT_TRUE(tree.isFrozen());
+  EXPECT_EQ(1, root.get<int>("a.b"));
+  EXPECT_EQ(5, root.get<int>("arr.1"));
+  EXPECT_FALSE(root.getOptional<int>("a.d"));
+
+  std::vector<std::string> keys;
+  root.getSubtree("a").listKeysRecursive(keys, true);
+  EXPECT_EQ(2u, keys.size());
+
+  EXPECT_THROW(root.set("a.b", 3), PropsError);
+  EXPECT_THROW(tree.clear(), PropsError);
+  EXPECT_EQ(1, root.get<int>("a.b"));
+}
+
+TEST(MxPropsTest, MemoryUsage)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("short", 1);
+  root.set("a_rather_long_key_that_is_not_stored_inline", std::string(100, 'x'));
+  PathPropData pd;
+  pd.isPathType = true;
+  PTree::Record r;
+  r.setValue("data/file.txt", pd);
+  root.setRecord("path", r);
+  root.undefine("gone");
+
+  PTree::MemoryUsage const u = tree.getMemoryUsage();
+  EXPECT_EQ(4u, u.records);
+  EXPECT_EQ(3u, u.definedRecords);
+  EXPECT_EQ(1u, u.pathDataRecords);
+  EXPECT_GT(u.keyBytes, 0u);
+  EXPECT_GT(u.valueBytes, 100u);
+  EXPECT_GT(u.totalBytes, u.keyBytes + u.valueBytes);
+  EXPECT_TRUE(root.getRecord("path").getPathData().isPathType);
+
+  tree.freeze();
+  EXPECT_EQ(3u, tree.getMemoryUsage().records);
+}
+
+TEST(MxPropsTest, Arena)
+{
+  PTree::Options options;
+  options.arenaChunkSize = 4096;
+  PTree tree(options);
+  PTree::Ref root = tree.root("my_root");
+
+  size_t firstLoadBytes = 0;
+  for (int reload = 0; reload < 3; ++reload)
+  {
+    for (int i = 0; i < 200; ++i)
+      root.set("key" + boost::lexical_cast<std::string>(i), i);
+    EXPECT_EQ(150, root.get<int>("key150"));
+
+    // chunks are reused by the next load instead of being reallocated
+    size_t const bytes = tree.getMemoryUsage().totalBytes;
+    if (reload == 0)
+      firstLoadBytes = bytes;
+    EXPECT_EQ(firstLoadBytes, bytes);
+
+    tree.clear();
+    EXPECT_FALSE(root.getOptional<int>("key150"));
+  }
+
+  // large blocks go back to the heap as soon as they are freed
+  Arena arena(4096);
+  void *small = arena.allocate(100);
+  size_t const reserved = arena.getReservedBytes();
+  void *big = arena.allocate(2000);
+  EXPECT_EQ(reserved + 2000, arena.getReservedBytes());
+  arena.deallocate(big, 2000);
+  EXPECT_EQ(reserved, arena.getReservedBytes());
+  void *blocks[3];
+  for (int i = 0; i < 3; ++i)
+    blocks[i] = arena.allocate(1024 * (i + 1));
+  arena.deallocate(blocks[1], 2048);
+  arena.deallocate(blocks[0], 1024);
+  EXPECT_EQ(reserved + 3072, arena.getReservedBytes());
+  arena.deallocate(blocks[2], 3072);
+  EXPECT_EQ(reserved, arena.getReservedBytes());
+  arena.deallocate(small, 100);
+  EXPECT_EQ(small, arena.allocate(100));
+}
+
+TEST(MxPropsTest, Conversion)
+{
+  EXPECT_EQ(42, *Converter<int>::parse(" +42 "));
+  EXPECT_EQ(-128, *Converter<signed char>::parse("-128"));
+  EXPECT_FALSE(Converter<signed char>::parse("128"));
+  EXPECT_FALSE(Converter<unsigned>::parse("-1"));
+  EXPECT_FALSE(Converter<int>::parse("4x"));
+  EXPECT_FALSE(Converter<int>::parse(""));
+  EXPECT_EQ("-9223372036854775808",
+            *Converter<long long>::format(std::numeric_limits<long long>::min()));
+
+  EXPECT_TRUE(*Converter<bool>::parse("1"));
+  EXPECT_FALSE(*Converter<bool>::parse("false"));
+  EXPECT_FALSE(Converter<bool>::parse("yes"));
+  EXPECT_EQ("true", *Converter<bool>::format(true));
+
+  double const values[] = { 0.1, 1.0 / 3, 1e-300, 123456789.125, -2.5e17 };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+  {
+    std::string const s = *Converter<double>::format(values[i]);
+    EXPECT_EQ(values[i], *Converter<double>::parse(s)) << s;
+  }
+  EXPECT_EQ("0.1", *Converter<double>::format(0.1));
+  EXPECT_EQ(2.5f, *Converter<float>::parse("2.5"));
+}
+
+struct CameraSettings
+{
+  double threshold;
+  int fps;
+  std::string name;
+  std::vector<int> roi;
+};
+
+TEST(MxPropsTest, Binding)
+{
+  PTree tree;
+  PTree::Ref cam = tree.root("my_root").getSubtree("camera");
+  cam.set("threshold", 0.75);
+  cam.set("name", std::string("front"));
+  cam.setArray("roi", std::vector<int>(4, 16));
+
+  Binding<CameraSettings> b;
+  b.field("threshold", &CameraSettings::threshold)
+   .field(MXPROPS_FIELD(CameraSettings, name))
+   .field("roi", &CameraSettings::roi)
+   .field(MXPROPS_FIELD(CameraSettings, fps), 25);
+
+  CameraSettings s;
+  b.read(cam, s);
+  EXPECT_EQ(0.75, s.threshold);
+  EXPECT_EQ(25, s.fps);
+  EXPECT_EQ("front", s.name);
+  EXPECT_EQ(4u, s.roi.size());
+
+  cam.set("threshold", std::string("high"));
+  cam.set("fps", std::string("fast"));
+  cam.undefine("name");
+  std::vector<std::string> messages;
+  EXPECT_FALSE(b.read(cam, s, messages));
+  EXPECT_EQ(3u, messages.size());
+  EXPECT_THROW(b.read(cam, s), PropsError);
+
+  // defaults convert to the member type
+  Binding<CameraSettings> defaults;
+  defaults.field("gain", &CameraSettings::threshold, 1)
+          .field("label", &CameraSettings::name, "none");
+  defaults.read(cam, s);
+  EXPECT_EQ(1.0, s.threshold);
+  EXPECT_EQ("none", s.name);
+}
+
+namespace {
+
+struct RemovingListener : public PTree::Listener
+{
+  PTree & tree;
+  size_t id;
+  int calls;
+
+  explicit RemovingListener(PTree & tree)
+  : tree(tree), id(0), calls(0)
+  { }
+
+  virtual void onChange(std::string const&, std::vector<PTree::Source::entry_t> const&)
+  {
+    ++calls;
+    tree.removeListener(id);
+  }
+};
+
+} // namespace
+
+TEST(MxPropsTest, Subscriptions)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("camera.fps", 25);
+
+  mxasync::PMessageQueue queue(new mxasync::MessageQueue());
+  size_t const id = subscribe(tree, "camera", queue);
+
+  root.set("network.port", 80);
+  root.set("camera.fps", 25);
+  EXPECT_EQ(0, queue->size());
+
+  PTree::Batch batch;
+  batch.set("fps", 30);
+  batch.set("threshold", 0.5);
+  batch.undefine("name");
+  root.getSubtree("camera").apply(batch);
+  ASSERT_EQ(1, queue->size());
+
+  PPropsChangedMessage const m = mxasync::msg_cast<PropsChangedMessage>(queue->pop());
+  ASSERT_TRUE(m);
+  ASSERT_EQ(2u, m->getChanges().size());
+  EXPECT_EQ("camera.fps", m->getChanges()[0].first);
+  EXPECT_EQ("30", m->getChanges()[0].second.getValue());
+  EXPECT_EQ(30, root.get<int>("camera.fps"));
+
+  tree.removeListener(id);
+  root.set("camera.fps", 10);
+  EXPECT_EQ(0, queue->size());
+
+  // a listener removed while a write is notifying is not called any more
+  mxasync::PMessageQueue late(new mxasync::MessageQueue());
+  RemovingListener * const remover = new RemovingListener(tree);
+  tree.addListener("camera", PTree::PListener(remover));
+  remover->id = subscribe(tree, "camera", late);
+  root.set("camera.fps", 11);
+  EXPECT_EQ(1, remover->calls);
+  EXPECT_EQ(0, late->size());
+}
+
+namespace {
+
+struct ReloadCountListener : public PTree::Listener
+{
+  ConfigWatcher const& watcher;
+  size_t seen;
+
+  explicit ReloadCountListener(ConfigWatcher const& watcher)
+  : watcher(watcher), seen(0)
+  { }
+
+  virtual void onChange(std::string const&, std::vector<PTree::Source::entry_t> const&)
+  {
+    seen = watcher.getReloadCount();
+  }
+};
+
+} // namespace
+
+TEST(MxPropsTest, ConfigWatcher)
+{
+  std::string const filename = "mxprops_test_watcher.json";
+  std::ofstream(filename.c_str()) << "{\"a\": 1, \"b\": 2, \"c\": 3}";
+
+  char const* argv[] = { "app", filename.c_str(), "-c=4" };
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  init_settings_from_command_line(root, 3, argv);
+
+  ConfigWatcher watcher(root);
+  watcher.addCommandLine(3, argv);
+
+  mxasync::PMessageQueue queue(new mxasync::MessageQueue());
+  subscribe(tree, "", queue);
+
+  std::ofstream(filename.c_str()) << "{\"a\": 1, \"b\": 20, \"c\": 30, \"d\": 5}";
+  std::vector<std::string> messages;
+  EXPECT_TRUE(watcher.reload(messages));
+  EXPECT_EQ(1u, watcher.getReloadCount());
+
+  // one batch with exactly the changed keys; the command line still wins
+  ASSERT_EQ(1, queue->size());
+  PPropsChangedMessage const changed = mxasync::msg_cast<PropsChangedMessage>(queue->pop());
+  ASSERT_TRUE(changed);
+  ASSERT_EQ(2u, changed->getChanges().size());
+  EXPECT_EQ(20, root.get<int>("b"));
+  EXPECT_EQ(4, root.get<int>("c"));
+  EXPECT_EQ(5, root.get<int>("d"));
+
+  EXPECT_TRUE(watcher.reload(messages));
+  EXPECT_EQ(1u, watcher.getReloadCount());
+
+  // a rewrite of the same size within the same second is still seen, and
+  // listeners may query the watcher while it applies
+  ReloadCountListener * const listener = new ReloadCountListener(watcher);
+  tree.addListener("", PTree::PListener(listener));
+  std::ofstream(filename.c_str()) << "{\"a\": 1, \"b\": 21, \"c\": 30, \"d\": 5}";
+  EXPECT_TRUE(watcher.reload(messages));
+  EXPECT_EQ(21, root.get<int>("b"));
+  EXPECT_EQ(2u, listener->seen);
+
+  // the background thread picks up changes again after a restart
+  watcher.start();
+  watcher.stop();
+  watcher.start();
+  std::ofstream(filename.c_str()) << "{\"a\": 1, \"b\": 22, \"c\": 30, \"d\": 5}";
+  for (int i = 0; i < 500 && watcher.getReloadCount() < 3; ++i)
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  watcher.stop();
+  EXPECT_EQ(3u, watcher.getReloadCount());
+  EXPECT_EQ(22, root.get<int>("b"));
+  std::remove(filename.c_str());
+}
+
+TEST(MxPropsTest, Layers)
+{
+  boost::shared_ptr<PTree> defaults(new PTree());
+  defaults->root("").set("camera.fps", 25);
+  defaults->root("").set("camera.threshold", 0.5);
+  defaults->root("").set("camera.name", std::string("default"));
+
+  boost::shared_ptr<PTree> files(new PTree());
+  files->root("").set("camera.fps", 30);
+  files->root("").undefine("camera.name");
+
+  // two instances share the same lower layers and differ on top
+  PTree cam1, cam2;
+  cam1.attach(PTree::layer(defaults), "defaults");
+  cam1.attach(PTree::layer(files), "files");
+  cam2.attach(PTree::layer(defaults), "defaults");
+  cam1.root("").set("camera.threshold", 0.75);
+
+  PTree::ConstRef r1 = cam1.root("");
+  EXPECT_EQ(30, r1.get<int>("camera.fps"));
+  EXPECT_EQ(0.75, r1.get<double>("camera.threshold"));
+  EXPECT_FALSE(r1.getOptional<std::string>("camera.name"));
+  EXPECT_EQ(25, cam2.root("").get<int>("camera.fps"));
+
+  EXPECT_EQ("files", *r1.getOrigin("camera.fps"));
+  EXPECT_EQ("", *r1.getOrigin("camera.threshold"));
+  EXPECT_FALSE(r1.getOrigin("camera.name"));
+
+  // changes in a lower layer are seen through cached resolutions
+  defaults->root("").set("camera.gain", 2);
+  EXPECT_EQ(2, r1.get<int>("camera.gain"));
+  files->root("").set("camera.gain", 3);
+  EXPECT_EQ(3, r1.get<int>("camera.gain"));
+  EXPECT_EQ("files", *r1.getOrigin("camera.gain"));
+
+  // more paths than the resolutions kept, so later ones evict earlier ones
+  for (int i = 0; i < 1000; ++i)
+    EXPECT_FALSE(r1.getOptional<int>("missing." + boost::lexical_cast<std::string>(i)));
+  EXPECT_EQ(30, r1.get<int>("camera.fps"));
+  EXPECT_EQ("files", *r1.getOrigin("camera.fps"));
+
+  std::vector<std::string> keys;
+  r1.getSubtree("camera").listKeysRecursive(keys);
+  ASSERT_EQ(3u, keys.size());
+  EXPECT_EQ("fps", keys[0]);
+  EXPECT_EQ("gain", keys[1]);
+  EXPECT_EQ("threshold", keys[2]);
+}
+
+TEST(MxPropsTest, IdOverrides)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("app");
+  root.set("detector.threshold", 0.5);
+  root.set("detector.window", 5);
+  root.set("detector.cam7.threshold", 0.9);
+  root.set("detector.app.cam7.window", 7);
+
+  PTree::ConstRef plain = tree.root("app").getSubtreeForSubId("detector", "cam7");
+  EXPECT_EQ(0.5, plain.get<double>("threshold"));
+
+  PTree::ConstRef cam7 = plain.withIdOverrides();
+  EXPECT_EQ("app.cam7", cam7.getId());
+  EXPECT_EQ(0.9, cam7.get<double>("threshold"));
+  EXPECT_EQ(7, cam7.get<int>("window"));
+  PTree::ConstRef cam8 = tree.root("app").withIdOverrides().getSubtreeForSubId("detector", "cam8");
+  EXPECT_EQ(0.5, cam8.get<double>("threshold"));
+
+  // the cached resolutions follow later writes
+  root.set("detector.cam8.threshold", 0.1);
+  EXPECT_EQ(0.1, cam8.get<double>("threshold"));
+  root.undefine("detector.cam7.threshold");
+  EXPECT_EQ(0.5, cam7.get<double>("threshold"));
+
+  tree.freeze();
+  EXPECT_EQ(0.1, cam8.get<double>("threshold"));
+  EXPECT_EQ(7, cam7.get<int>("window"));
+}
+
+TEST(MxPropsTest, LargeConfig)
+{
+  std::string const filename = "mxprops_test_large.json";
+  {
+    std::ofstream out(filename.c_str());
+    out << "{";
+    for (int s = 0; s < 100; ++s)
+    {
+      out << (s ? ",\n" : "\n") << "\"s" << s << "\": {";
+      for (int k = 0; k < 500; ++k)
+        out << (k ? ", " : "") << "\"k" << k << "\": " << s * 500 + k;
+      out << "}";
+    }
+    out << "\n}\n";
+  }
+
+  PTree tree;
+  std::vector<std::string> messages;
+  ASSERT_TRUE(load_from_json_file(tree.root(""), messages, filename));
+  std::remove(filename.c_str());
+
+  PTree::ConstRef root = tree.root("");
+  std::vector<std::string> keys;
+  root.listKeysRecursive(keys);
+  EXPECT_EQ(50000u, keys.size());
+  keys.clear();
+  root.listKeys(keys);
+  EXPECT_EQ(100u, keys.size());
+  EXPECT_EQ(49999, root.get<int>("s99.k499"));
+  EXPECT_EQ(1234, root.get<int>("s2.k234"));
+}
+
+TEST(MxPropsTest, AccessTracking)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("");
+  root.set("cam.fps", 25);
+  root.set("cam.name", "front");
+  root.set("cam.unused", 1);
+  root.setArray("cam.gains", std::vector<int>(3, 1));
+
+  EXPECT_EQ(25, root.get<int>("cam.fps"));
+  EXPECT_TRUE(tree.getAccessStats().empty());
+
+  tree.setAccessTracking(true);
+  PTree::ConstRef cam = tree.root("").getSubtree("cam");
+  for (int i = 0; i < 3; ++i)
+    EXPECT_EQ(25, cam.get<int>("fps"));
+  EXPECT_EQ(1, cam.get<int>("gains.2"));
+  boost::thread t(boost::bind(&PTree::ConstRef::getRecord, cam, "name"));
+  t.join();
+  EXPECT_FALSE(cam.getOptional<int>("missing"));
+
+  PTree::access_stats_t const stats = tree.getAccessStats();
+  ASSERT_EQ(1u, stats.count("cam.fps"));
+  EXPECT_EQ(3u, stats.find("cam.fps")->second.reads);
+  EXPECT_FALSE(stats.find("cam.fps")->second.lastRead.is_special());
+  EXPECT_EQ(1u, stats.find("cam.name")->second.reads);
+  EXPECT_EQ(1u, stats.find("cam.missing")->second.reads);
+
+  std::vector<std::string> unread;
+  tree.listUnreadKeys(unread);
+  ASSERT_EQ(1u, unread.size());
+  EXPECT_EQ("cam.unused", unread[0]);
+
+  tree.resetAccessStats();
+  tree.setAccessTracking(false);
+  cam.get<int>("fps", 0);
+  EXPECT_TRUE(tree.getAccessStats().empty());
+}
+
+namespace {
+
+// Reads "a" from *tree once per round, between two waits on the barrier, and
+// keeps the thread alive across rounds.
+struct RoundReader
+{
+  PTree * const* tree;
+  boost::barrier & barrier;
+  std::vector<int> & seen;
+
+  RoundReader(PTree * const* tree, boost::barrier & barrier, std::vector<int> & seen)
+  : tree(tree), barrier(barrier), seen(seen)
+  { }
+
+  void operator () ()
+  {
+    for (size_t i = 0; i < seen.size(); ++i)
+    {
+      barrier.wait();
+      seen[i] = (*tree)->root("").get<int>("a");
+      barrier.wait();
+    }
+  }
+};
+
+} // namespace
+
+TEST(MxPropsTest, AccessTrackingTreeRebuilt)
+{
+  // the second tree is built at the address of the first one
+  boost::aligned_storage<sizeof(PTree), boost::alignment_of<PTree>::value> storage;
+  PTree *tree = new (storage.address()) PTree();
+  tree->root("").set("a", 1);
+  tree->setAccessTracking(true);
+
+  boost::barrier barrier(2);
+  std::vector<int> seen(2, 0);
+  boost::thread worker(RoundReader(&tree, barrier, seen));
+  barrier.wait();
+  barrier.wait();
+  EXPECT_EQ(1u, tree->getAccessStats().find("a")->second.reads);
+
+  tree->~PTree();
+  tree = new (storage.address()) PTree();
+  tree->root("").set("a", 2);
+  tree->setAccessTracking(true);
+  barrier.wait();
+  barrier.wait();
+  worker.join();
+
+  EXPECT_EQ(2, seen[1]);
+  PTree::access_stats_t const stats = tree->getAccessStats();
+  ASSERT_EQ(1u, stats.count("a"));
+  EXPECT_EQ(1u, stats.find("a")->second.reads);
+  tree->~PTree();
+}
+
+namespace {
+
+// Blocks lookups of "blocked" until released, holding the tree lock.
+class BlockingSource : public PTree::Source
+{
+public:
+  BlockingSource()
+  : entered(false), released(false)
+  { }
+
+  virtual bool find(std::string const& path, PTree::Record &) const
+  {
+    if (path != "blocked")
+      return false;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    entered = true;
+    changed.notify_all();
+    while (!released)
+      changed.wait(lock);
+    return false;
+  }
+
+  virtual void listRecords(std::string const&, std::vector<entry_t> &) const
+  { }
+
+  void waitEntered()
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!entered)
+      changed.wait(lock);
+  }
+
+  void release()
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    released = true;
+    changed.notify_all();
+  }
+
+private:
+  mutable boost::mutex mutex;
+  mutable boost::condition_variable changed;
+  mutable bool entered;
+  bool released;
+};
+
+} // namespace
+
+TEST(MxPropsTest, LockStats)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("");
+  root.set("a", 1);
+  EXPECT_EQ(0u, tree.getLockStats().write.acquisitions);
+
+  tree.setLockStats(true);
+  root.set("a", 2);
+  root.set("b", 3);
+  EXPECT_EQ(2, root.get<int>("a"));
+
+  // one thread never waits
+  PTree::LockStats stats = tree.getLockStats();
+  EXPECT_EQ(2u, stats.write.acquisitions);
+  EXPECT_EQ(1u, stats.read.acquisitions);
+  EXPECT_EQ(0u, stats.write.contended);
+  EXPECT_EQ(0u, stats.read.contended);
+  EXPECT_EQ(2u, stats.write.waitHistogram[0]);
+  EXPECT_EQ(1u, stats.read.waitHistogram[0]);
+
+  // a reader holds the lock inside a source lookup while a writer comes in
+  boost::shared_ptr<BlockingSource> source(new BlockingSource());
+  tree.attach(source);
+  tree.resetLockStats();
+  boost::thread reader(boost::bind(&PTree::ConstRef::getRecord, PTree::ConstRef(root), "blocked"));
+  source->waitEntered();
+  PTree::Batch batch;
+  batch.set("b", 4);
+  boost::thread writer(boost::bind(&PTree::Ref::apply, root, batch));
+  while (tree.getLockStats().write.waiting == 0)
+    boost::this_thread::yield();
+  source->release();
+  reader.join();
+  writer.join();
+  stats = tree.getLockStats();
+  EXPECT_EQ(1u, stats.write.acquisitions);
+  EXPECT_EQ(1u, stats.read.acquisitions);
+  EXPECT_EQ(1u, stats.write.contended);
+  EXPECT_EQ(0u, stats.read.contended);
+  EXPECT_GT(stats.write.waitMax, 0u);
+  EXPECT_EQ(0u, stats.write.waiting);
+
+  Json::Value doc;
+  ASSERT_TRUE(Json::Reader().parse(stats.toJson(), doc));
+  EXPECT_EQ(1u, doc["write"]["contended"].asUInt());
+  tree.detach();
+  EXPECT_EQ(static_cast<unsigned>(PTree::LockStats::HISTOGRAM_SIZE), doc["read"]["wait_us_histogram"].size());
+
+  tree.resetLockStats();
+  tree.freeze();
+  EXPECT_EQ(3, tree.root("").get<int>("a", 0) + 1);
+  EXPECT_EQ(0u, tree.getLockStats().read.acquisitions);
+}
+
+namespace
+{
+MXPROPS_CONSTEXPR Key<int> const kFps("cam.fps");
+MXPROPS_CONSTEXPR Key<std::string> const kName("cam.name");
+MXPROPS_CONSTEXPR Key<double> const kGain("gain");
+#if __cplusplus >= 201103L
+static_assert(kFps.getHash() == hashLiteral("cam.fps", 7), "key hash is a constant");
+#endif
+}
+
+TEST(MxPropsTest, CompileTimeKeys)
+{
+  EXPECT_EQ(PTree::hashPath("cam.fps", 7), kFps.getHash());
+
+  PTree tree;
+  PTree::Ref root = tree.root("");
+  root.set(kFps, 25);
+  root.set(kName, "front");
+  root.set("cam.gain", "x");
+  root.set("cam.lens.gain", 1.5);
+
+  EXPECT_EQ(25, root.get(kFps));
+  EXPECT_EQ("none", root.get(Key<std::string>("cam.label"), "none"));
+  root.getSubtree("lens2").set(kGain, 2);  // int converts to the key's double
+  EXPECT_EQ(1.5, root.getSubtree("cam.lens").get(kGain));
+
+  tree.freeze();
+  PTree::ConstRef frozen = tree.root("");
+  EXPECT_EQ(25, frozen.get(kFps));
+  EXPECT_EQ("front", frozen.get(kName));
+  EXPECT_EQ(1.5, frozen.getSubtree("cam.lens").get(kGain));
+  EXPECT_EQ(2.0, frozen.getSubtree("lens2").get(kGain));
+  EXPECT_EQ(2.0, frozen.getSubtree("cam").get(kGain, 2.0));
+  EXPECT_THROW(frozen.getSubtree("cam").get(kGain), PropsError);
+  EXPECT_FALSE(frozen.getSubtree("cam.lens.gain").getOptional(kGain));
+  EXPECT_EQ(3.0, frozen.get(kGain, 3.0));
+}
+
+TEST(MxPropsTest, Schema)
+{
+  Schema schema;
+  schema.field<std::string>("camera.name")
+        .field("camera.gain", 1.5)
+        .range("camera.fps", 1, 120, 25)
+        .range("camera.threshold", 0.0, 1.0);
+
+  Json::Value doc;
+  ASSERT_TRUE(Json::Reader().parse("{\"camera\": {\"name\": \"front\", \"fps\": \" +30\", \"threshold\": 0.25}}", doc));
+  PTree tree;
+  std::vector<std::string> messages;
+  ASSERT_TRUE(load_from_json(tree.root(""), messages, doc, schema));
+  EXPECT_TRUE(messages.empty());
+
+  PTree::ConstRef cam = tree.root("").getSubtree("camera");
+  EXPECT_EQ(30, cam.get<int>("fps"));
+  EXPECT_EQ("30", cam.get<std::string>("fps"));  // stored canonical
+  EXPECT_EQ(1.5, cam.get<double>("gain"));
+  EXPECT_EQ(0.25, cam.get<double>("threshold"));
+  EXPECT_EQ(30.0, cam.get<double>("fps"));       // other types still parse
+
+  // every bad path is reported
+  char const* argv[] = { "app", "-camera.fps=500", "-camera.threshold=x" };
+  PTree bad;
+  messages.clear();
+  EXPECT_FALSE(load_from_command_line(bad.root(""), messages, 3, argv, schema));
+  ASSERT_EQ(3u, messages.size());
+  EXPECT_EQ("Out of range camera.fps", messages[0]);
+  EXPECT_EQ("Undefined property: camera.name", messages[1]);
+  EXPECT_EQ("Bad format camera.threshold", messages[2]);
+  EXPECT_FALSE(bad.root("").getOptional<std::string>("camera.fps"));
+  EXPECT_FALSE(bad.root("").getOptional<std::string>("camera.threshold"));
+
+  // nor does a bad value reach a tree that held good ones
+  ASSERT_TRUE(Json::Reader().parse("{\"camera\": {\"fps\": 500, \"gain\": 2}}", doc));
+  messages.clear();
+  EXPECT_FALSE(load_from_json(tree.root(""), messages, doc, schema));
+  ASSERT_EQ(1u, messages.size());
+  EXPECT_EQ(30, cam.get<int>("fps"));
+  EXPECT_EQ(1.5, cam.get<double>("gain"));
+  bad.root("").set("camera.threshold", "x");
+  messages.clear();
+  EXPECT_FALSE(schema.apply(bad.root(""), messages));
+  EXPECT_FALSE(bad.root("").getOptional<double>("camera.gain"));
+
+  // checking is not reading: nothing shows up in the access statistics
+  tree.setAccessTracking(true);
+  messages.clear();
+  EXPECT_TRUE(schema.apply(tree.root(""), messages));
+  EXPECT_TRUE(tree.getAccessStats().empty());
+}
+
+TEST(MxPropsTest, DiffAndPatch)
+{
+  PTree master;
+  PTree::Ref m = master.root("");
+  m.set("cam.fps", 25);
+  m.set("cam.name", "front");
+  m.setArray("cam.roi", std::vector<int>(4, 0));
+
+  PTree worker;
+  std::vector<std::string> messages;
+  PTree::Batch patch;
+  PTree::diff(worker.root(""), master.root(""), patch);
+  EXPECT_EQ(3u, patch.size());
+  worker.root("").apply(patch);
+
+  boost::uint64_t const synced = master.getVersion();
+  m.set("cam.fps", 30);
+  m.undefine("cam.name");
+  m.set("cam.gain", 2);
+  m.set("other.x", 1);
+
+  PTree::Batch delta;
+  master.root("").getSubtree("cam").getChangesSince(synced, delta);
+  ASSERT_EQ(3u, delta.size());
+  EXPECT_EQ("fps", delta.getEntries()[0].path);
+  EXPECT_EQ(PTree::Batch::UNDEFINE, delta.getEntries()[2].op);
+
+  // over the wire
+  Json::Value doc;
+  batch_to_json(delta, doc);
+  PTree::Batch received;
+  ASSERT_TRUE(batch_from_json(doc, received, messages));
+  worker.root("").getSubtree("cam").apply(received);
+
+  EXPECT_EQ(30, worker.root("").get<int>("cam.fps"));
+  EXPECT_EQ(2, worker.root("").get<int>("cam.gain"));
+  EXPECT_FALSE(worker.root("").getOptional<std::string>("cam.name"));
+  EXPECT_EQ(4u, worker.root("").getArray<int>("cam.roi").size());
+
+  PTree::Batch rest;
+  PTree::diff(worker.root("").getSubtree("cam"), master.root("").getSubtree("cam"), rest);
+  EXPECT_TRUE(rest.empty());
+  PTree::diff(worker.root(""), master.root(""), rest);
+  ASSERT_EQ(1u, rest.size());
+  EXPECT_EQ("other.x", rest.getEntries()[0].path);
+
+  EXPECT_FALSE(batch_from_json(Json::Value(1), received, messages));
+}
+
+struct SharedReader
+{
+  PTree::ConstRef tree;
+  boost::atomic<bool> done;
+  bool ok;
+
+  SharedReader(PTree::ConstRef const& tree)
+  : tree(tree), done(false), ok(true)
+  { }
+
+  void operator () ()
+  {
+    while (!done)
+    {
+      int const v = tree.get<int>("cam.fps", 0);
+      ok = ok && v >= 25 && v <= 200;
+    }
+  }
+};
+
+TEST(MxPropsTest, SharedMemory)
+{
+  // per process, so that concurrent test runs do not share the segment
+  std::string const name = "mxprops_test_shared_" + boost::lexical_cast<std::string>(getpid());
+  PTree master;
+  master.root("").set("cam.fps", 25);
+  master.root("").setArray("cam.roi", std::vector<int>(4, 1));
+
+  SharedTreeWriter writer(name, 1 << 16);
+  boost::shared_ptr<SharedTree> shared(new SharedTree(name));
+  EXPECT_EQ(0u, shared->size());
+
+  std::vector<std::string> messages;
+  ASSERT_TRUE(writer.publish(master.root(""), messages));
+  PTree worker;
+  worker.attach(shared, "shared");
+  worker.attach(PTree::layer(boost::make_shared<PTree>()), "local");
+  PTree::ConstRef w = worker.root("");
+  EXPECT_EQ(25, w.get<int>("cam.fps"));
+  EXPECT_EQ(4u, w.getArray<int>("cam.roi").size());
+  EXPECT_EQ("shared", *w.getOrigin("cam.fps"));
+
+  // readers keep up with a publishing writer
+  SharedReader r(w);
+  boost::thread reader(boost::ref(r));
+  for (int i = 26; i <= 200; ++i)
+  {
+    master.root("").set("cam.fps", i);
+    ASSERT_TRUE(writer.publish(master.root(""), messages));
+    EXPECT_EQ(i, w.get<int>("cam.fps"));
+  }
+  r.done = true;
+  reader.join();
+  EXPECT_TRUE(r.ok);
+  EXPECT_EQ(176u, writer.getVersion());
+
+  PTree big;
+  big.root("").set("blob", std::string(1 << 17, 'x'));
+  EXPECT_FALSE(writer.publish(big.root(""), messages));
+  EXPECT_EQ(1u, messages.size());
+  EXPECT_THROW(SharedTree("mxprops_test_missing"), std::runtime_error);
+}
+
+TEST(MxPropsTest, SubtreeOperations)
+{
+  boost::shared_ptr<PTree> defaults = boost::make_shared<PTree>();
+  defaults->root("").set("cams.front.gain", 2);
+
+  PTree tree;
+  tree.attach(PTree::layer(defaults), "defaults");
+  PTree::Ref root = tree.root("");
+  root.set("cams.front.fps", 25);
+  root.set("cams.front.lens.focus", 1.5);
+  root.set("cams.frontier", 1);
+  root.set("cams.back.fps", 10);
+  root.set("cams.back.old", 3);
+
+  boost::uint64_t const before = tree.getVersion();
+  root.getSubtree("cams").copySubtree("front", "back");
+  std::vector<std::string> keys;
+  root.getSubtree("cams.back").listKeysRecursive(keys);
+  ASSERT_EQ(3u, keys.size());
+  EXPECT_EQ("fps", keys[0]);
+  EXPECT_EQ("gain", keys[1]);
+  EXPECT_EQ("lens.focus", keys[2]);
+  EXPECT_EQ(25, root.get<int>("cams.back.fps"));
+
+  root.moveSubtree("cams.front", "cams.side");
+  EXPECT_FALSE(root.getOptional<int>("cams.front.fps"));
+  EXPECT_FALSE(root.getOptional<int>("cams.front.gain")); // masked
+  EXPECT_EQ(1, root.get<int>("cams.frontier"));
+  EXPECT_EQ(1.5, root.get<double>("cams.side.lens.focus"));
+  EXPECT_THROW(root.moveSubtree("cams", "cams.x"), PropsError);
+
+  size_t const records = tree.getMemoryUsage().records;
+  root.eraseSubtree("cams.side");
+  EXPECT_EQ(records - 3, tree.getMemoryUsage().records);
+  EXPECT_FALSE(root.getOptional<int>("cams.side.fps"));
+
+  // a replica catches up through the erasures
+  PTree replica;
+  replica.root("").set("cams.front.fps", 25);
+  replica.root("").set("cams.back.old", 3);
+  PTree::Batch delta;
+  root.getChangesSince(before, delta);
+  Json::Value doc;
+  batch_to_json(delta, doc);
+  PTree::Batch received;
+  std::vector<std::string> messages;
+  ASSERT_TRUE(batch_from_json(doc, received, messages));
+  replica.root("").apply(received);
+  EXPECT_FALSE(replica.root("").getOptional<int>("cams.front.fps"));
+  EXPECT_FALSE(replica.root("").getOptional<int>("cams.back.old"));
+  EXPECT_EQ(25, replica.root("").get<int>("cams.back.fps"));
+  EXPECT_EQ(2, replica.root("").get<int>("cams.back.gain"));
+}
+
+TEST(MxPropsTest, Export)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("");
+  root.set("cam.fps", 25);
+  root.set("cam.name", "front \"left\"\n");
+  root.set("cam.lens", 4);
+  root.set("cam.lens.focus", 1.5);
+  root.set("cam.lens-type", "wide");
+  root.setArray("cam.roi", std::vector<int>(2, 7));
+  root.set("cam.zones.0.x", 1);
+  root.set("cam.zones.1.x", 2);
+  root.set("cam.zones.10.x", 11);
+  for (int i = 2; i < 10; ++i)
+    root.set("cam.zones." + boost::lexical_cast<std::string>(i) + ".x", i + 1);
+  root.set("cam.code", "007");
+  root.set("cam.ratio", "1.50");
+  root.set("cam.exposure", "1e3");
+  root.set("cam.serial", "12345678901");
+  root.set("cam.scale", 0.25);
+  root.set("cam.mask", 4294967295u);
+
+  std::ostringstream json;
+  std::vector<std::string> messages;
+  ASSERT_TRUE(save_to_json(root, messages, json));
+
+  Json::Value doc;
+  ASSERT_TRUE(Json::Reader().parse(json.str(), doc));
+  ASSERT_TRUE(doc["cam"]["zones"].isArray());
+  EXPECT_EQ(11u, doc["cam"]["zones"].size());
+  EXPECT_EQ(11, doc["cam"]["zones"][10]["x"].asInt());
+  EXPECT_EQ(4, doc["cam"]["lens"][""].asInt());
+  EXPECT_TRUE(doc["cam"]["code"].isString());
+  EXPECT_TRUE(doc["cam"]["ratio"].isString());
+  EXPECT_TRUE(doc["cam"]["exposure"].isString());
+  EXPECT_TRUE(doc["cam"]["serial"].isString());
+  EXPECT_TRUE(doc["cam"]["scale"].isDouble());
+  EXPECT_TRUE(doc["cam"]["mask"].isUInt());
+
+  PTree copy;
+  ASSERT_TRUE(load_from_json(copy.root(""), messages, doc));
+  PTree::Batch difference;
+  PTree::diff(tree.root(""), copy.root(""), difference);
+  EXPECT_TRUE(difference.empty()) << json.str();
+
+  std::ostringstream props;
+  ASSERT_TRUE(save_to_properties(root.getSubtree("cam.lens"), messages, props));
+  EXPECT_EQ("=4\nfocus=1.5\n", props.str());
+  props.str("");
+  ASSERT_TRUE(save_to_properties(root.getSubtree("cam.roi"), messages, props));
+  EXPECT_EQ("0=7\n1=7\n", props.str());
+
+  std::ostringstream empty;
+  ASSERT_TRUE(save_to_json(PTree().root(""), messages, empty));
+  EXPECT_EQ("{}\n", empty.str());
+
+  // attached sources are exported merged, own undefines masking them
+  boost::shared_ptr<PTree> defaults(new PTree());
+  defaults->root("").set("cam.fps", 10);
+  defaults->root("").set("cam.zoom", 2);
+  PTree layered;
+  layered.attach(PTree::layer(defaults));
+  layered.root("").undefine("cam.fps");
+  layered.root("").set("cam.name", "side");
+  std::ostringstream merged;
+  ASSERT_TRUE(save_to_json(layered.root("").getSubtree("cam"), messages, merged));
+  EXPECT_EQ("{\n  \"name\": \"side\",\n  \"zoom\": 2\n}\n", merged.str());
+
+  // one message per failure
+  messages.clear();
+  EXPECT_FALSE(save_to_json_file(root, messages, "no_such_dir/x.json"));
+  EXPECT_EQ(1u, messages.size());
+
+  // keys with an empty segment fail instead of being dropped
+  char const* const emptySegment[] = { "a.", "a..b" };
+  for (size_t i = 0; i < 2; ++i)
+  {
+    PTree odd;
+    odd.root("").set(emptySegment[i], 1);
+    std::ostringstream out;
+    messages.clear();
+    EXPECT_FALSE(save_to_json(odd.root(""), messages, out)) << emptySegment[i];
+    EXPECT_EQ(1u, messages.size());
+    odd.root("").set("a.c", 2);
+    EXPECT_FALSE(save_to_json(odd.root(""), messages, out)) << emptySegment[i];
+    EXPECT_FALSE(save_to_properties(odd.root(""), messages, out)) << emptySegment[i];
+  }
+}
+
+TEST(MxPropsTest, PropertiesFile)
+{
+  std::string const filename = "mxprops_test.properties";
+  {
+    std::ofstream f(filename.c_str(), std::ios::binary);
+    f << "# camera\n\n  cam.fps = 25\r\ncam.name=front = left\n\t\ncam.scale=1.5";
+  }
+
+  PTree tree;
+  std::vector<std::string> messages;
+  ASSERT_TRUE(load_from_properties_file(tree.root(""), messages, filename));
+  PTree::ConstRef cam = tree.root("").getSubtree("cam");
+  EXPECT_EQ(25, cam.get<int>("fps"));
+  EXPECT_EQ("front = left", cam.get<std::string>("name"));
+  EXPECT_EQ(1.5, cam.get<double>("scale"));
+
+  ASSERT_TRUE(save_to_properties_file(tree.root(""), messages, filename));
+  PTree copy;
+  ASSERT_TRUE(load_from_properties_file(copy.root(""), messages, filename));
+  PTree::Batch difference;
+  PTree::diff(tree.root(""), copy.root(""), difference);
+  EXPECT_TRUE(difference.empty());
+
+  {
+    std::ofstream f(filename.c_str(), std::ios::binary);
+    f << "a=1\nb\n";
+  }
+  PTree bad;
+  EXPECT_FALSE(load_from_properties_file(bad.root(""), messages, filename));
+  EXPECT_FALSE(bad.root("").getOptional<int>("a"));
+  EXPECT_NE(std::string::npos, messages.back().find(filename + ":2:"));
+
+  {
+    std::ofstream f(filename.c_str(), std::ios::binary);
+  }
+  EXPECT_TRUE(load_from_properties_file(bad.root(""), messages, filename));
+  std::remove(filename.c_str());
+  EXPECT_FALSE(load_from_properties_file(bad.root(""), messages, filename));
+}
+
+TEST(MxPropsTest, MultipleJsonFiles)
+{
+  std::vector<std::string> filenames;
+  for (int i = 0; i < 8; ++i)
+  {
+    filenames.push_back("mxprops_test_" + boost::lexical_cast<std::string>(i) + ".json");
+    std::ofstream f(filenames.back().c_str());
+    f << "{\"cam\": {\"fps\": " << i << ", \"id" << i << "\": " << i << "}}";
+  }
+
+  PTree tree;
+  std::vector<std::string> messages;
+  ASSERT_TRUE(load_from_json_files(tree.root(""), messages, filenames));
+  EXPECT_EQ(7, tree.root("").get<int>("cam.fps"));
+  for (int i = 0; i < 8; ++i)
+    EXPECT_EQ(i, tree.root("").get<int>("cam.id" + boost::lexical_cast<std::string>(i)));
+
+  char const* argv[] = { "app", "-cam.fps=100", filenames[2].c_str(), filenames[1].c_str(), "-cam.id3=30" };
+  PTree cmd;
+  init_settings_from_command_line(cmd.root(""), 5, argv);
+  EXPECT_EQ(1, cmd.root("").get<int>("cam.fps"));
+  EXPECT_EQ(30, cmd.root("").get<int>("cam.id3"));
+
+  std::remove(filenames[5].c_str());
+  PTree partial;
+  EXPECT_FALSE(load_from_json_files(partial.root(""), messages, filenames));
+  EXPECT_EQ(4, partial.root("").get<int>("cam.fps"));
+  EXPECT_FALSE(partial.root("").getOptional<int>("cam.id6"));
+
+  for (size_t i = 0; i < filenames.size(); ++i)
+    std::remove(filenames[i].c_str());
+}
+
+namespace {
+
+struct SourceReader
+{
+  PTree::Source const& source;
+  int & found;
+
+  SourceReader(PTree::Source const& source, int & found)
+  : source(source), found(found)
+  { }
+
+  void operator () () const
+  {
+    char const* const paths[] = { "models.b.zones.1.x", "cam.fps", "models.a.scale" };
+    for (int i = 0; i < 100; ++i)
+      for (size_t k = 0; k < 3; ++k)
+      {
+        PTree::Record r;
+        if (source.find(paths[k], r) && r.isDefined())
+          ++found;
+      }
+  }
+};
+
+} // namespace
+
+TEST(MxPropsTest, LazyJsonSource)
+{
+  std::string const filename = "mxprops_test_lazy.json";
+  {
+    std::ofstream f(filename.c_str());
+    f << "// lookup tables\n"
+         "{\"models\": {\"a\": {\"scale\": 1.50, \"size\": [3, 4], \"on\": true},\n"
+         "            \"b\": {\"name\": \"q\\\"}{\", \"zones\": [{\"x\": 1}, {\"x\": -20}], \"big\": 1e3}},\n"
+         " \"cam\": {\"fps\": 25, \"off\": null, \"dotted.key\": {\"v\": 0}, \"empty\": {}, \"list\": []},\n"
+         " /* [{ */ \"\\u0041\": \"\\u00e9\"}\n";
+  }
+
+  boost::shared_ptr<JsonSource> source(new JsonSource(filename));
+  PTree tree;
+  tree.attach(source, "lazy");
+  PTree::ConstRef root = tree.root("");
+  EXPECT_EQ(0u, source->getLoadedCount());
+  EXPECT_EQ(25, root.get<int>("cam.fps"));
+  EXPECT_EQ(4u, source->getLoadedCount());
+  EXPECT_EQ(0, root.get<int>("cam.dotted.key.v"));
+  EXPECT_EQ("q\"}{", root.get<std::string>("models.b.name"));
+  EXPECT_EQ(-20, root.get<int>("models.b.zones.1.x"));
+  EXPECT_EQ("lazy", *root.getOrigin("cam.fps"));
+
+  PTree loaded;
+  std::vector<std::string> messages;
+  ASSERT_TRUE(load_from_json_file(loaded.root(""), messages, filename));
+  PTree::Batch difference;
+  PTree::diff(loaded.root(""), tree.root(""), difference);
+  EXPECT_TRUE(difference.empty());
+  std::vector<std::string> keys;
+  tree.root("").listKeysRecursive(keys);
+  EXPECT_EQ(source->getLoadedCount(), keys.size() + 1); // cam.off is undefined
+
+  // readers share the source; the first lookups below a container load it
+  JsonSource fresh(filename);
+  std::vector<int> found(4, 0);
+  boost::thread_group group;
+  for (size_t t = 0; t < found.size(); ++t)
+    group.create_thread(SourceReader(fresh, found[t]));
+  group.join_all();
+  for (size_t t = 0; t < found.size(); ++t)
+    EXPECT_EQ(300, found[t]);
+
+  {
+    std::ofstream f(filename.c_str());
+    f << "{\"a\": [1, 2}";
+  }
+  EXPECT_THROW(JsonSource bad(filename), std::runtime_error);
+  std::remove(filename.c_str());
+}
+
+namespace
+{
+// A source whose lookups wait until the given number of them overlap, or
+// give up after a second.
+struct RendezvousSource : PTree::Source
+{
+  size_t const expected;
+  mutable boost::mutex mutex;
+  mutable boost::condition_variable arrived;
+  mutable size_t inside;
+  mutable bool met;
+
+  explicit RendezvousSource(size_t expected)
+  : expected(expected), inside(0), met(false)
+  { }
+
+  virtual bool find(std::string const& path, PTree::Record & r) const
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (++inside == expected)
+    {
+      met = true;
+      arrived.notify_all();
+    }
+    boost::system_time const deadline = boost::get_system_time() + boost::posix_time::seconds(1);
+    while (!met && arrived.timed_wait(lock, deadline))
+      ;
+    r.setValue(path);
+    return true;
+  }
+
+  virtual void listRecords(std::string const&, std::vector<entry_t> &) const
+  { }
+};
+}
+
+TEST(MxPropsTest, SharedReadLock)
+{
+  boost::shared_ptr<RendezvousSource> source(new RendezvousSource(3));
+  PTree::Options options;
+  options.sharedReads = true;
+  PTree tree(options);
+  tree.setLockStats(true);
+  tree.attach(source);
+  tree.root("").set("network.port", 80);
+
+  // readers of unrelated subtrees, one through an id override, are inside
+  // the tree at the same time
+  boost::thread_group group;
+  group.create_thread(boost::bind(&PTree::ConstRef::getRecord, tree.root(""), "cameras.fps"));
+  group.create_thread(boost::bind(&PTree::ConstRef::getRecord, tree.root(""), "network.host"));
+  group.create_thread(boost::bind(&PTree::ConstRef::getRecord, tree.root("cam1").withIdOverrides(), "cameras.gain"));
+  group.join_all();
+  EXPECT_TRUE(source->met);
+  EXPECT_EQ(0u, tree.getLockStats().read.contended);
+
+  EXPECT_EQ("cam1.cameras.gain", tree.root("cam1").withIdOverrides().get<std::string>("cameras.gain"));
+  EXPECT_EQ(80, tree.root("").get<int>("network.port"));
+}
+
+TEST(MxPropsTest, OverrideCacheAfterDetach)
+{
+  boost::shared_ptr<PTree> upper(new PTree());
+  upper->root("").set("cam1.cam.fps", 30);
+  upper->root("").set("x", 1);
+  upper->root("").set("y", 1);
+
+  PTree tree;
+  tree.root("").set("cam.fps", 25);
+  tree.attach(PTree::layer(upper));
+  EXPECT_EQ(30, tree.root("cam1").withIdOverrides().get<int>("cam.fps"));
+
+  // the tree version catches up with the sum it had with the layer attached
+  tree.detach();
+  tree.root("").set("a", 1);
+  tree.root("").set("b", 1);
+  EXPECT_EQ(25, tree.root("cam1").withIdOverrides().get<int>("cam.fps"));
+}
+
+TEST(MxPropsTest, ReadCache)
+{
+  PTree tree;
+  tree.setReadCache(true);
+  PTree::Ref root = tree.root("");
+  root.set("cam.fps", 25);
+  root.set("cam1.cam.fps", 30);
+  root.set("cam.name", "front");
+
+  PTree::ConstRef cam = root.getSubtree("cam");
+  EXPECT_EQ(25, cam.get<int>("fps"));
+  EXPECT_EQ(25, cam.get<int>("fps"));
+  EXPECT_EQ(25.0, cam.get<double>("fps"));
+  EXPECT_EQ(30, tree.root("cam1").withIdOverrides().get<int>("cam.fps"));
+  EXPECT_EQ(25, tree.root("cam1").get<int>("cam.fps"));
+  EXPECT_FALSE(cam.getOptional<int>("name"));
+  EXPECT_THROW(cam.get<int>("name"), PropsError);
+  EXPECT_THROW(cam.get<int>("missing"), PropsError);
+
+  // a write invalidates what every thread has cached for its path
+  root.set("cam.gain", 2);
+  EXPECT_EQ(25, cam.get<int>("fps"));
+  root.set("cam.fps", 50);
+  EXPECT_EQ(50, cam.get<int>("fps"));
+  root.undefine("cam.fps");
+  EXPECT_FALSE(cam.getOptional<int>("fps"));
+  EXPECT_EQ(7, cam.get<int>("missing", 7));
+
+  // override candidates, index keys and paths of numbers alone
+  PTree::ConstRef cam2 = tree.root("cam2").withIdOverrides();
+  EXPECT_EQ(1, cam2.get<int>("cam.width", 1));
+  root.set("cam2.cam.width", 640);
+  EXPECT_EQ(640, cam2.get<int>("cam.width", 1));
+  root.set("cam.width", 320);
+  root.undefine("cam2.cam.width");
+  EXPECT_EQ(320, cam2.get<int>("cam.width", 1));
+  std::vector<int> roi(2, 1);
+  root.setArray("cam.roi", roi);
+  EXPECT_EQ(1, cam.get<int>("roi.1"));
+  EXPECT_EQ(1, root.getSubtree("cam.roi").get<int>("1"));
+  roi[1] = 2;
+  root.setArray("cam.roi", roi);
+  EXPECT_EQ(2, cam.get<int>("roi.1"));
+  EXPECT_EQ(2, root.getSubtree("cam.roi").get<int>("1"));
+
+  // erasing a subtree invalidates everything
+  EXPECT_EQ(30.0, tree.root("cam1").withIdOverrides().get<double>("cam.fps"));
+  root.eraseSubtree("cam1");
+  EXPECT_FALSE(tree.root("cam1").withIdOverrides().getOptional<double>("cam.fps"));
+
+  // attached sources change without writes to the tree, so they bypass it
+  boost::shared_ptr<PTree> defaults(new PTree());
+  defaults->root("").set("cam.zoom", 10);
+  tree.attach(PTree::layer(defaults));
+  EXPECT_EQ(10, cam.get<int>("zoom"));
+  defaults->root("").set("cam.zoom", 12);
+  EXPECT_EQ(12, cam.get<int>("zoom"));
+}
+
+TEST(MxPropsTest, ReadCacheThreads)
+{
+  boost::aligned_storage<sizeof(PTree), boost::alignment_of<PTree>::value> storage;
+  PTree *tree = new (storage.address()) PTree();
+  tree->setReadCache(true);
+  tree->root("").set("a", 1);
+
+  boost::barrier barrier(2);
+  std::vector<int> seen(3, 0);
+  boost::thread worker(RoundReader(&tree, barrier, seen));
+  barrier.wait();
+  barrier.wait();
+
+  // the worker's cached get sees a write made after its first read
+  tree->root("").set("a", 2);
+  barrier.wait();
+  barrier.wait();
+
+  // a tree rebuilt at the same address, at the version the worker cached
+  tree->~PTree();
+  tree = new (storage.address()) PTree();
+  tree->setReadCache(true);
+  tree->root("").set("a", 3);
+  tree->root("").set("b", 0);
+  barrier.wait();
+  barrier.wait();
+  worker.join();
+  tree->~PTree();
+
+  EXPECT_EQ(1, seen[0]);
+  EXPECT_EQ(2, seen[1]);
+  EXPECT_EQ(3, seen[2]);
+}
+
 int main(int argc, char *argv[])
 {
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,78 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+#include "mxprops.h"
+#include <mxasync/actor.hpp>
+
+
+namespace mxprops {
+
+// Keeps a Ref in sync with the JSON files it was loaded from.  When a file
+// changes on disk it is parsed again, the sources are merged in their
+// original order, and only the keys whose values differ from the previous
+// merge are written, as one batch.  The diff is against that merge, not the
+// tree: a key the application changed in the tree keeps its value until the
+// key itself changes in the sources.  Files are watched with inotify, so the
+// background thread is only available on Linux; reload() works everywhere,
+// though where stat has no sub-second times (Windows), a rewrite within the
+// same second that keeps the size is missed.
+class ConfigWatcher : public mxasync::Actor
+{
+public:
+  explicit ConfigWatcher(PTree::Ref const& dst);
+  ~ConfigWatcher();
+
+  // Register sources in the order they were loaded, before start().
+  // Both throw std::runtime_error if a source cannot be parsed.
+  void addJsonFile(std::string const& filename);
+  // the same arguments as given to init_settings_from_command_line
+  void addCommandLine(int argc, char const* argv[]);
+
+  // re-parses files modified since the last call; false if one failed to
+  // parse, in which case its previous contents are kept
+  bool reload(std::vector<std::string> & messages);
+
+  // starts the background thread; may be called again after stop()
+  void start();
+  void stop();
+
+  size_t getReloadCount() const;
+  std::vector<std::string> getLastMessages() const;
+
+protected:
+  virtual void run();
+
+private:
+  struct Impl;
+  boost::scoped_ptr<Impl> impl;
+};
+
+}